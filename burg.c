@@ -5,7 +5,9 @@
 #include <assert.h>
 #include <limits.h>
 #include <ctype.h>
+#include <time.h>
 #include "burg.h"
+#include "burgrt.h"
 
 /*
   The following symbols must be defined in the
@@ -20,13 +22,44 @@
       };
       typedef struct node NODE_TYPE;
   
-  LEFT_KID(p): left kid of 'p'
+  KID(p, i): the i-th kid of 'p' (counting from 0)
 
-  RIGHT_KID(p): right kid of 'p'
+  LEFT_KID(p), RIGHT_KID(p): left and right kid of 'p', used to
+  define KID when it is not defined and no terminal has more than
+  two kids
 
   NODE_OP(p): op of 'p'
 
   NODE_STATE(p): state of 'p'
+
+  NODE_SIZE(p): optional with -parallel, the number of nodes in the
+  subtree of 'p'
+
+  With -context NODE_STATE is not used, the states are kept in a
+  ?ctx passed to ?label(ctx, p) and ?rule(ctx, p, nt), see ?ctx_init.
+
+  NODE_ID(p): optional with -context, a dense index of 'p' into the
+  array of states given to ?ctx_init
+
+  With -cxx the generated code is a C++17 header instead, where the
+  labeler is a template over a traits type:
+      struct traits : ?node_traits {
+          typedef struct node node_type;
+          static int op(node_type *p);
+          static node_type *kid(node_type *p, int i);
+          static ?state *&state(node_type *p);
+      };
+  and ?label<traits>(p), ?kids<traits>(p, ruleno, kids) take typed nodes.
+
+  With -array the tree is an array of NODE_TYPE in post-order and the
+  states are kept in a parallel array of struct ?state:
+      ?label_array(nodes, states, n) labels nodes[0..n-1],
+      ?kids(nodes, p, ruleno, kids) writes kid indexes,
+  with
+  KID_INDEX(p, i): the index of the i-th kid of 'p', less than the
+  index of 'p'
+
+  instead of KID and NODE_STATE.
  */
 
 #define STR_HASH_INIT       5381
@@ -37,9 +70,12 @@
 #define NEWARRAY(size, n)   calloc(n, size)
 #define NODE_TYPE           "NODE_TYPE"
 #define NODE_OP             "NODE_OP"
+#define KID                 "KID"
 #define LEFT_KID            "LEFT_KID"
 #define RIGHT_KID           "RIGHT_KID"
 #define NODE_STATE          "NODE_STATE"
+#define KID_INDEX           "KID_INDEX"
+#define NODE_ID             "NODE_ID"
 #define MAX_COST            SHRT_MAX
 
 enum { TERM, NONTERM };
@@ -57,7 +93,30 @@ struct entry {
 static const char progname[] = "burg";
 static const char version[] = "1.0";
 static char *prefix = "_";
-static int trace;
+static int trace;                 /* -T */
+static unsigned int ring;         /* -ring: size of the trace ring buffer */
+static int binary;                /* -B */
+static int cxx;                   /* -cxx */
+static const char *node_type = NODE_TYPE;
+static int split;                 /* -split: number of label partitions */
+static int flat;                  /* -flat */
+static int share;                 /* -share */
+static char **share_code;         /* -share: cost code of dynamic rules, by ern */
+static int array;                 /* -array */
+static int parallel;              /* -parallel */
+static int context;               /* -context */
+static int ctx_kids;              /* kid states of ?label are in kids[] */
+static int need;                  /* -need */
+static int batch;                 /* -batch */
+static int pipeline;              /* -pipeline */
+static int const_leaves;          /* -const */
+static char **model_names;        /* cost models (%costs) */
+static int num_models;            /* count of cost models */
+static int cur_model;             /* cost model being emitted */
+static int stats;                 /* --stats */
+static struct outbuf *out;        /* current output */
+static char *prologue_buf;        /* text between %{ and %} */
+static size_t prologue_len, prologue_cap;
 static struct entry *tokens[512];
 static struct nonterm *start;
 static unsigned int num_rules;    /* count of rules */
@@ -66,41 +125,103 @@ static unsigned int num_nonterms; /* count of nonterms */
 static struct nonterm *nonterms;  /* all nonterms */
 static unsigned int num_terms;    /* count of terms */
 static struct term *terms;        /* all terms */
+static int max_kids;              /* max nkids of all terms */
+static int max_nts;               /* max length of ?nts */
+
+/*
+  Output is formatted into a growable buffer and written out in one go
+  by `flush_output' or `commit', so a run costs a few large writes
+  instead of a stdio call per character.
+ */
+struct outbuf {
+    char *data;
+    size_t len, cap;
+};
+
+static void die(const char *fmt, ...);
+
+static void ogrow(struct outbuf *b, size_t n)
+{
+    size_t cap = b->cap ? b->cap : 1 << 16;
+
+    while (cap - b->len < n)
+        cap *= 2;
+    if ((b->data = realloc(b->data, cap)) == NULL)
+        die("out of memory");
+    b->cap = cap;
+}
+
+static void owrite(struct outbuf *b, const void *s, size_t n)
+{
+    if (b->cap - b->len < n)
+        ogrow(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void oputc(int c, struct outbuf *b)
+{
+    if (b->len == b->cap)
+        ogrow(b, 1);
+    b->data[b->len++] = c;
+}
+
+static void oputs(const char *s, struct outbuf *b)
+{
+    owrite(b, s, strlen(s));
+}
+
+/* printf a single number */
+static void onum(struct outbuf *b, const char *fmt, ...)
+{
+    char buf[32];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    owrite(b, buf, n);
+}
 
-static void fprint(FILE *fp, const char *fmt, ...);
+static void fprint(struct outbuf *fp, const char *fmt, ...);
 
-static void vfprint(FILE *fp, const char *fmt, va_list ap)
+static void vfprint(struct outbuf *fp, const char *fmt, va_list ap)
 {
     for (; *fmt; fmt++) {
         if (*fmt == '%') {
             switch (*++fmt) {
             case 'd':
-                fprintf(fp, "%d", va_arg(ap, int));
+                onum(fp, "%d", va_arg(ap, int));
                 break;
             case 'u':
-                fprintf(fp, "%u", va_arg(ap, unsigned int));
+                onum(fp, "%u", va_arg(ap, unsigned int));
                 break;
             case 'x':
-                fprintf(fp, "%x", va_arg(ap, int));
+                onum(fp, "%x", va_arg(ap, int));
                 break;
             case 'X':
-                fprintf(fp, "%X", va_arg(ap, int));
+                onum(fp, "%X", va_arg(ap, int));
                 break;
             case 's':
-                fputs(va_arg(ap, char *), fp);
+                oputs(va_arg(ap, char *), fp);
+                break;
+                /* storage class of tables */
+            case 'S':
+                oputs(cxx ? "inline constexpr " : split ? "" : "static ", fp);
                 break;
             case 'p':
-                fprintf(fp, "%p", va_arg(ap, void *));
+                onum(fp, "%p", va_arg(ap, void *));
                 break;
                 /* pattern */
             case 'P':
                 {
                     struct pattern *p = va_arg(ap, struct pattern *);
                     fprint(fp, "%K", p->op);
-                    if (p->left && p->right)
-                        fprint(fp, "(%P, %P)", p->left, p->right);
-                    else if (p->left)
-                        fprint(fp, "(%P)", p->left);
+                    for (int i = 0; i < p->nkids; i++)
+                        fprint(fp, "%s%P", i ? ", " : "(", p->kids[i]);
+                    if (p->nkids)
+                        oputc(')', fp);
                 }
                 break;
                 /* rule */
@@ -114,12 +235,12 @@ static void vfprint(FILE *fp, const char *fmt, va_list ap)
             case 'K':
                 {
                     struct term *t = va_arg(ap, struct term *);
-                    fputs(t->name, fp);
+                    oputs(t->name, fp);
                 }
                 break;
                 /* prefix */
             case '?':
-                fputs(prefix, fp);
+                oputs(prefix, fp);
                 break;
                 /* tab indent */
             case '1':
@@ -131,23 +252,22 @@ static void vfprint(FILE *fp, const char *fmt, va_list ap)
             case '7':
             case '8':
             case '9':
-                {
-                    int n = *fmt - '0';
-                    while (n-- > 0)
-                        putc('\t', fp);
-                }
+                owrite(fp, "\t\t\t\t\t\t\t\t\t", *fmt - '0');
                 break;
             default:
-                putc(*fmt, fp);
+                oputc(*fmt, fp);
                 break;
             }
         } else {
-            putc(*fmt, fp);
+            /* copy the literal run up to the next directive */
+            size_t n = strcspn(fmt, "%");
+            owrite(fp, fmt, n);
+            fmt += n - 1;
         }
     }
 }
 
-static void fprint(FILE *fp, const char *fmt, ...)
+static void fprint(struct outbuf *fp, const char *fmt, ...)
 {
     va_list ap;
 
@@ -161,7 +281,7 @@ static void print(const char *fmt, ...)
     va_list ap;
 
     va_start(ap, fmt);
-    vfprint(stdout, fmt, ap);
+    vfprint(out, fmt, ap);
     va_end(ap);
 }
 
@@ -299,18 +419,15 @@ struct term *term(char *name, int val)
     return t;
 }
 
-struct pattern *pattern(char *name, struct pattern *l, struct pattern *r)
+/* `kids' are linked by `link'. */
+struct pattern *pattern(char *name, struct pattern *kids)
 {
     struct term *t = lookup(name); /* term or nonterm */
-    int nkids;
+    int nkids = 0;
     struct pattern *p;
 
-    if (l && r)
-        nkids = 2;
-    else if (l)
-        nkids = 1;
-    else
-        nkids = 0;
+    for (struct pattern *k = kids; k; k = k->link)
+        nkids++;
 
     if (t == NULL && nkids == 0)
         t = (struct term *)nonterm(name);
@@ -325,27 +442,136 @@ struct pattern *pattern(char *name, struct pattern *l, struct pattern *r)
         yyerror("inconsistent kids in termial '%s' (%d != %d)",
                 name, t->nkids, nkids);
 
+    if (nkids > max_kids)
+        max_kids = nkids;
+
     p = NEWS0(struct pattern);
     p->op = t;
-    p->left = l;
-    p->right = r;
+    p->nkids = nkids;
+    p->kids = NEWARRAY(sizeof(struct pattern *), nkids);
     /* count terms in the pattern */
     p->nterms = t->kind == TERM;
-    if (p->left)
-        p->nterms += p->left->nterms;
-    if (p->right)
-        p->nterms += p->right->nterms;
+    for (int i = 0; kids; kids = kids->link, i++) {
+        p->kids[i] = kids;
+        p->nterms += kids->nterms;
+    }
     return p;
 }
 
+/* collect the prologue, it's printed after parsing. */
+void prologue(int c)
+{
+    if (prologue_len + 1 >= prologue_cap) {
+        prologue_cap = prologue_cap ? prologue_cap * 2 : 1024;
+        prologue_buf = realloc(prologue_buf, prologue_cap);
+    }
+    prologue_buf[prologue_len++] = c;
+    prologue_buf[prologue_len] = 0;
+}
+
+/* number of nonterm leaves in `p' */
+static int count_nts(struct pattern *p)
+{
+    int n = 0;
+
+    if (((struct term *)p->op)->kind == NONTERM)
+        return 1;
+    for (int i = 0; i < p->nkids; i++)
+        n += count_nts(p->kids[i]);
+    return n;
+}
+
+void cost_model(char *name)
+{
+    if (num_rules)
+        yyerror("%costs must precede the rules");
+    model_names = realloc(model_names, (num_models + 1) * sizeof(char *));
+    model_names[num_models++] = name;
+}
+
 /* cost may be code or digits. */
+static void parse_cost(char *cost, char **code, int *value)
+{
+    char *endptr;
+
+    *code = cost;
+    *value = strtol(cost, &endptr, 10);
+    if (*endptr) {
+        /* invalid */
+        *value = -1;
+        *code = format("(%s)", cost);
+    }
+}
+
+/*
+  With %costs the costs are columns separated by `;', the last column
+  applies to the models left. There are no more columns than models,
+  a single one included.
+ */
+static void parse_costs(struct rule *r, char *cost)
+{
+    char *semi = NULL;
+
+    r->codes = NEWARRAY(sizeof(char *), num_models);
+    r->costs = NEWARRAY(sizeof(int), num_models);
+    for (int i = 0; i < num_models; i++) {
+        char *col, *end;
+
+        semi = strchr(cost, ';');
+        col = semi ? xstrndup(cost, semi - cost) : cost;
+        end = col + strlen(col);
+
+        while (isspace((unsigned char)*col))
+            col++;
+        while (end > col && isspace((unsigned char)end[-1]))
+            *--end = 0;
+        parse_cost(*col ? col : "0", &r->codes[i], &r->costs[i]);
+        if (semi)
+            cost = semi + 1;
+    }
+    if (semi)
+        yyerror("more cost columns than %costs");
+    r->code = r->codes[0];
+    r->cost = r->costs[0];
+}
+
+/* emit the costs of the model `m' */
+static void select_model(int m)
+{
+    cur_model = m;
+    if (num_models > 1)
+        for (struct rule *r = rules; r; r = r->link) {
+            r->code = r->codes[m];
+            r->cost = r->costs[m];
+        }
+}
+
+/* `[m]' of the cost model being emitted, if several */
+static char *mcol(void)
+{
+    return num_models > 1 ? format("[%d]", cur_model) : "";
+}
+
+/* `_m' suffix of closures of the cost model being emitted */
+static char *msuffix(void)
+{
+    return num_models > 1 ? format("_%s", model_names[cur_model]) : "";
+}
+
+/* the code of the dynamic cost of `r', taken from the key with -share */
+static char *dyn_code(struct rule *r)
+{
+    if (share_code && share_code[r->ern])
+        return share_code[r->ern];
+    return r->code;
+}
+
 struct rule *rule(char *name, struct pattern *pattern, char *template, char *cost)
 {
     struct term *op = pattern->op;
     struct nonterm *nt;
     struct rule *r;
     struct rule **p;
-    char *endptr;
 
     nt = nonterm(name);
 
@@ -353,14 +579,14 @@ struct rule *rule(char *name, struct pattern *pattern, char *template, char *cos
     r->nterm = nt;
     r->pattern = pattern;
     r->template = template;
-    r->code = cost;
-    r->cost = strtol(cost, &endptr, 10);
-    if (*endptr) {
-        /* invalid */
-        r->cost = -1;
-        r->code = format("(%s)", cost);
-    }
+    r->regs = -1;
+    if (num_models > 0)
+        parse_costs(r, cost);
+    else
+        parse_cost(cost, &r->code, &r->cost);
     r->ern = ++num_rules;
+    if (count_nts(pattern) > max_nts)
+        max_nts = count_nts(pattern);
     r->irn = ++nt->nrules;
 
     for (p = &nt->rules; *p && (*p)->irn < r->irn; p = &(*p)->nlink)
@@ -372,7 +598,7 @@ struct rule *rule(char *name, struct pattern *pattern, char *template, char *cos
     if (op->kind == TERM) {
         r->tlink = op->rules;
         op->rules = r;
-    } else if (pattern->left == NULL && pattern->right == NULL) {
+    } else if (pattern->nkids == 0) {
         struct nonterm *nterm = (struct nonterm *)op;
         r->chain = nterm->chain;
         nterm->chain = r;
@@ -387,18 +613,99 @@ struct rule *rule(char *name, struct pattern *pattern, char *template, char *cos
     return r;
 }
 
+/* KID(var, i) */
+static char *kid_expr_at(const char *var, const char *i)
+{
+    if (array)
+        return format("%s(&nodes[%s], %s)", KID_INDEX, var, i);
+    if (cxx)
+        return format("Traits::kid(%s, %s)", var, i);
+    return format("%s(%s, %s)", KID, var, i);
+}
+
+static char *kid_expr(const char *var, int i)
+{
+    return kid_expr_at(var, format("%d", i));
+}
+
+/* NODE_OP(var) */
+static char *op_expr(const char *var)
+{
+    if (array)
+        return format("%s(&nodes[%s])", NODE_OP, var);
+    if (cxx)
+        return format("Traits::op(%s)", var);
+    return format("%s(%s)", NODE_OP, var);
+}
+
+/* the typed state of `var' */
+static char *state_expr(const char *var)
+{
+    if (context) {
+        for (int i = 0; ctx_kids && i < max_kids; i++)
+            if (!strcmp(var, kid_expr("t", i)))
+                return format("kids[%d]", i);
+        return format("%sctx_get(ctx, %s)", prefix, var);
+    }
+    if (array)
+        return format("(&states[%s])", var);
+    if (cxx)
+        return format("Traits::state(%s)", var);
+    return format("((struct %sstate *)(%s(%s)))", prefix, NODE_STATE, var);
+}
+
+/* the node `var' as a pointer */
+static char *node_expr(const char *var)
+{
+    if (array)
+        return format("&nodes[%s]", var);
+    return (char *)var;
+}
+
+/* the parameter `var' of node, an index with -array */
+static char *node_param(const char *var)
+{
+    if (array)
+        return format("int %s", var);
+    return format("%s *%s", node_type, var);
+}
+
+/* `nodes, states, ' with -array, `ctx, ' with -context */
+static const char *extra_params(void)
+{
+    if (array)
+        return format("%s *nodes, struct %sstate *states, ", node_type, prefix);
+    if (context)
+        return format("struct %sctx *ctx, ", prefix);
+    return "";
+}
+
+static const char *extra_args(void)
+{
+    if (array)
+        return "nodes, states, ";
+    if (context)
+        return "ctx, ";
+    return "";
+}
+
+/* `static ret ' or the template head of a member of ?labeler */
+static void emit_head(const char *ret)
+{
+    if (cxx)
+        print("template <class Traits>\n%s %?labeler<Traits>::", ret);
+    else
+        print("%s%s ", split ? "" : "static ", ret);
+}
+
 /* See also: compute_nts */
 static char *compute_kids(struct pattern *p, char *sub, char *bp, int *idx)
 {
     struct term *t = p->op;
     
     if (t->kind == TERM) {
-        if (p->left)
-            bp = compute_kids(p->left,
-                              format("%s(%s)", LEFT_KID, sub), bp, idx);
-        if (p->right)
-            bp = compute_kids(p->right,
-                              format("%s(%s)", RIGHT_KID, sub), bp, idx);
+        for (int i = 0; i < p->nkids; i++)
+            bp = compute_kids(p->kids[i], kid_expr(sub, i), bp, idx);
     } else {
         sprintf(bp, "\t\tkids[%d] = %s;\n", (*idx)++, sub);
         bp += strlen(bp);
@@ -406,6 +713,181 @@ static char *compute_kids(struct pattern *p, char *sub, char *bp, int *idx)
     return bp;
 }
 
+/* ?kids(NODE_TYPE *p, int ruleno, NODE_TYPE *kids[]), see also: node_param */
+static void emit_kids_head(void)
+{
+    if (array)
+        print("%?kids(%s *nodes, int p, int ruleno, int kids[])\n", node_type);
+    else
+        print("%?kids(%s *p, int ruleno, %s *kids[])\n", node_type, node_type);
+}
+
+/*
+  Flat encoding (-flat) of ?nts and ?kids.
+
+  The nonterm sequences of all rules are stored in one array ?nts_flat,
+  and ?nts_offset[ruleno] is where the sequence of `ruleno' starts. The
+  kid paths are stored in ?kid_paths in parallel with ?nts_flat: each
+  path is a 1 followed by the kid indexes from the node down to the
+  kid, `flat_bits' bits per step, first step in the lowest bits. A path
+  of 1 is the node itself, and 0 terminates the sequence.
+ */
+static int flat_bits;             /* bits per step */
+static int *flat_nts;             /* ?nts_flat */
+static unsigned int *flat_paths;  /* ?kid_paths */
+static int *flat_offset;          /* ?nts_offset */
+static int flat_len;
+
+static struct nonterm *nonterm_of(int number)
+{
+    struct nonterm *nt = nonterms;
+
+    while (nt->number != number)
+        nt = nt->link;
+    return nt;
+}
+
+static void compute_paths(struct pattern *p, unsigned int path, int depth,
+                          int *nts, unsigned int *paths, int *n)
+{
+    struct term *t = p->op;
+
+    if (t->kind == NONTERM) {
+        nts[*n] = ((struct nonterm *)t)->number;
+        paths[(*n)++] = path | 1u << (depth * flat_bits);
+        return;
+    }
+    if ((depth + 1) * flat_bits >= 32)
+        die("pattern too deep: %s", t->name);
+    for (int i = 0; i < p->nkids; i++)
+        compute_paths(p->kids[i], path | (unsigned int)i << (depth * flat_bits),
+                      depth + 1, nts, paths, n);
+}
+
+/* build the flat tables, sharing equal sequences */
+static void build_flat(void)
+{
+    int cap = 16;
+
+    flat_bits = max_kids > 1 ? bits(max_kids - 1) : 1;
+    flat_nts = NEWARRAY(sizeof(int), cap);
+    flat_paths = NEWARRAY(sizeof(unsigned int), cap);
+    flat_offset = NEWARRAY(sizeof(int), num_rules + 1);
+    flat_nts[0] = 0;
+    flat_paths[0] = 0;
+    flat_len = 1;               /* ruleno 0 points to an empty sequence */
+
+    for (struct rule *r = rules; r; r = r->link) {
+        int nts[max_nts + 1];
+        unsigned int paths[max_nts + 1];
+        int n = 0, i;
+
+        compute_paths(r->pattern, 0, 0, nts, paths, &n);
+        nts[n] = 0;
+        paths[n] = 0;
+        /* lookup */
+        for (i = 0; i + n < flat_len; i++)
+            if (!memcmp(&flat_nts[i], nts, (n + 1) * sizeof(int)) &&
+                !memcmp(&flat_paths[i], paths, (n + 1) * sizeof(int)))
+                break;
+        if (i + n >= flat_len) {
+            i = flat_len;
+            while (flat_len + n + 1 > cap) {
+                cap *= 2;
+                flat_nts = realloc(flat_nts, cap * sizeof(int));
+                flat_paths = realloc(flat_paths, cap * sizeof(unsigned int));
+            }
+            memcpy(&flat_nts[i], nts, (n + 1) * sizeof(int));
+            memcpy(&flat_paths[i], paths, (n + 1) * sizeof(int));
+            flat_len += n + 1;
+        }
+        flat_offset[r->ern] = i;
+    }
+}
+
+/* smallest unsigned type for values up to `max' */
+static const char *flat_type(unsigned int max)
+{
+    if (max <= UCHAR_MAX)
+        return "unsigned char";
+    else if (max <= USHRT_MAX)
+        return "unsigned short";
+    return "unsigned int";
+}
+
+static const char *flat_paths_type(void)
+{
+    unsigned int max = 0;
+
+    for (int i = 0; i < flat_len; i++)
+        max = flat_paths[i] > max ? flat_paths[i] : max;
+    return flat_type(max);
+}
+
+/*
+  static short ?nts_flat[] = { ... };
+  static unsigned short ?nts_offset[] = { ... };
+  static unsigned char ?kid_paths[] = { ... };
+ */
+static void emit_var_nts_flat(void)
+{
+    print("%Sshort %?nts_flat[] = {\n");
+    for (int i = 0; i < flat_len; i++) {
+        if (flat_nts[i])
+            print("%s%?%K_NT,", i && flat_nts[i - 1] ? " " : "\t",
+                  nonterm_of(flat_nts[i]));
+        else
+            print("%s0,\n", i && flat_nts[i - 1] ? " " : "\t");
+    }
+    print("};\n\n");
+
+    print("%S%s %?nts_offset[] = {\n", flat_type(flat_len));
+    print("%10,\n");
+    for (struct rule *r = rules; r; r = r->link)
+        print("%1%d, // %d. %R\n", flat_offset[r->ern], r->ern, r);
+    print("};\n\n");
+
+    print("%S%s %?kid_paths[] = {\n", flat_paths_type());
+    for (int i = 0; i < flat_len; i++)
+        print("%s0x%x,%s", i && flat_paths[i - 1] ? " " : "\t",
+              flat_paths[i], flat_paths[i] ? "" : "\n");
+    print("};\n\n");
+}
+
+/*
+  static void ?kids(NODE_TYPE *p, int ruleno, NODE_TYPE *kids[])
+  {
+      short *nts = &?nts_flat[?nts_offset[ruleno]];
+      ... kid paths ... *path = &?kid_paths[?nts_offset[ruleno]];
+
+      for (int i = 0; nts[i]; i++) {
+          NODE_TYPE *k = p;
+          for (unsigned int s = path[i]; s != 1; s >>= flat_bits)
+              k = KID(k, s & mask);
+          kids[i] = k;
+      }
+  }
+ */
+static void emit_func_kids_flat(void)
+{
+    emit_head("void");
+    emit_kids_head();
+    print("{\n");
+    print("%1const %s *path;\n\n", flat_paths_type());
+    print("%1assert(%s && \"%s\");\n", array ? "p >= 0" : "p", "null tree");
+    print("%1assert(kids && \"%s\");\n", "null kids for writing");
+    print("%1assert(ruleno > 0 && ruleno <= %d);\n\n", num_rules);
+    print("%1path = &%?kid_paths[%?nts_offset[ruleno]];\n");
+    print("%1for (; *path; path++) {\n");
+    print("%2%s = p;\n", node_param("k"));
+    print("%2for (unsigned int s = *path; s != 1; s >>= %d)\n", flat_bits);
+    print("%3k = %s;\n",
+          kid_expr_at("k", format("s & 0x%x", (1 << flat_bits) - 1)));
+    print("%2*kids++ = k;\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
 /*
   Function: ?kids(NODE_TYPE *p, int ruleno, NODE_TYPE *kids[])
 
@@ -431,6 +913,10 @@ static char *compute_kids(struct pattern *p, char *sub, char *bp, int *idx)
  */
 static void emit_func_kids(void)
 {
+    if (flat) {
+        emit_func_kids_flat();
+        return;
+    }
     int i;
     struct rule *r;
     int *nts = NEWARRAY(sizeof(int), num_rules);
@@ -448,10 +934,10 @@ static void emit_func_kids(void)
         nts[i] = j;
     }
 
-    print("static void %?kids(%s *p, int ruleno, %s *kids[])\n",
-          NODE_TYPE, NODE_TYPE);
+    emit_head("void");
+    emit_kids_head();
     print("{\n");
-    print("%1assert(p && \"%s\");\n", "null tree");
+    print("%1assert(%s && \"%s\");\n", array ? "p >= 0" : "p", "null tree");
     print("%1assert(kids && \"%s\");\n\n", "null kids for writing");
     print("%1switch (ruleno) {\n");
     /* cases */
@@ -497,15 +983,30 @@ static void emit_func_kids(void)
  */
 static void emit_func_rule(void)
 {
-    print("static int %?rule(void *state, int nt)\n");
-    print("{\n");
+    if (cxx) {
+        print("inline int %?rule(const %?state *state, int nt)\n");
+    } else if (context) {
+        emit_head("int");
+        print("%?rule(struct %?ctx *ctx, %s *p, int nt%s)\n",
+              node_type, num_models > 1 ? ", int model" : "");
+        print("{\n");
+        print("%1struct %?state *state = %?ctx_get(ctx, p);\n\n");
+    } else {
+        emit_head("int");
+        print("%?rule(void *state, int nt%s)\n", num_models > 1 ? ", int model" : "");
+    }
+    if (!context)
+        print("{\n");
     print("%1if (!state)\n");
     print("%2return 0;\n");
     print("%1switch (nt) {\n");
     for (struct nonterm *nt = nonterms; nt; nt = nt->link) {
         print("%1case %?%K_NT: /* %d */\n", nt, nt->number);
-        print("%2return %?%K_rules[((struct %?state *)state)->rule.%K];\n",
-              nt, nt);
+        if (cxx)
+            print("%2return %?%K_rules[state->rule.%K];\n", nt, nt);
+        else
+            print("%2return %?%K_rules[((struct %?state *)state)->rule%s.%K];\n",
+                  nt, num_models > 1 ? "[model]" : "", nt);
     }
     print("%1default:\n");
     print("%2abort();\n");
@@ -513,25 +1014,157 @@ static void emit_func_rule(void)
     print("}\n\n");
 }
 
+/*
+  Register need (-need).
+
+  Each state records, for every nonterm, the Sethi-Ullman number of the
+  selected derivation: the registers needed to evaluate the node when
+  its nonterm kids are evaluated in decreasing order of need, at least
+  the registers of the rule itself. A rule may give them as `[n]' after
+  its pattern; otherwise instructions take 1 and other rules 0.
+
+  ?kids_ordered(p, ruleno, kids, nts) is ?kids with the kids (and their
+  nonterms) in that order.
+ */
+static int is_instruction(struct rule *r)
+{
+    int len = r->template ? strlen(r->template) : 0;
+
+    return len >= 2 &&
+        r->template[len - 2] == '\\' &&
+        r->template[len - 1] == 'n';
+}
+
+static int rule_regs(struct rule *r)
+{
+    return r->regs >= 0 ? r->regs : is_instruction(r);
+}
+
+/* the needs of the nonterm leaves of `p' at `var' */
+static char *compute_needs(struct pattern *p, char *var, char *bp)
+{
+    struct term *t = p->op;
+
+    if (t->kind == TERM) {
+        for (int i = 0; i < p->nkids; i++)
+            bp = compute_needs(p->kids[i], kid_expr(var, i), bp);
+    } else {
+        sprintf(bp, ", %s->need%s[%s%s_NT]",
+                strcmp(var, "t") ? state_expr(var) : "p", mcol(), prefix, t->name);
+        bp += strlen(bp);
+    }
+    return bp;
+}
+
+/* p->need[?xx_NT] of the rule `r' */
+static char *need_expr(struct rule *r)
+{
+    char buf[4096];
+    int n = count_nts(r->pattern);
+
+    if (n == 0)
+        return format("%d", rule_regs(r));
+    *compute_needs(r->pattern, "t", buf) = 0;
+    if (n == 1)
+        return format("%sneed1(%d, %s)", prefix, rule_regs(r), buf + 2);
+    return format("%sneed(%d, %d, (const int []){ %s })",
+                  prefix, rule_regs(r), n, buf + 2);
+}
+
+static void emit_func_need(void)
+{
+    print("static int %?need1(int regs, int need)\n");
+    print("{\n");
+    print("%1return need > regs ? need : regs;\n");
+    print("}\n\n");
+    print("static int %?need(int regs, int n, const int needs[])\n");
+    print("{\n");
+    print("%1int sorted[%d], need = regs;\n\n", max_nts + 1);
+    print("%1for (int i = 0; i < n; i++) {\n");
+    print("%2int j;\n");
+    print("%2for (j = i; j > 0 && sorted[j - 1] < needs[i]; j--)\n");
+    print("%3sorted[j] = sorted[j - 1];\n");
+    print("%2sorted[j] = needs[i];\n");
+    print("%1}\n");
+    print("%1for (int i = 0; i < n; i++)\n");
+    print("%2if (sorted[i] + i > need)\n");
+    print("%3need = sorted[i] + i;\n");
+    print("%1return need;\n");
+    print("}\n\n");
+}
+
+static void emit_func_kids_ordered(void)
+{
+    const char *kid = array ? "int " : format("%s *", node_type);
+
+    const char *m = num_models > 1 ? "[model]" : "";
+
+    print("static void %?kids_ordered(%s%s, int ruleno, %skids[], short nts[]%s)\n",
+          extra_params(), node_param("p"), kid, *m ? ", int model" : "");
+    print("{\n");
+    print("%1const short *s = %?NTS(ruleno);\n");
+    print("%1int n;\n\n");
+    print("%1%?kids(%sp, ruleno, kids);\n", array ? "nodes, " : "");
+    print("%1for (n = 0; s[n]; n++) {\n");
+    print("%2%sk = kids[n];\n", kid);
+    print("%2int j, need = %s->need%s[s[n]];\n\n", state_expr("k"), m);
+    print("%2for (j = n; j > 0 && %s->need%s[nts[j - 1]] < need; j--) {\n",
+          state_expr("kids[j - 1]"), m);
+    print("%3kids[j] = kids[j - 1];\n");
+    print("%3nts[j] = nts[j - 1];\n");
+    print("%2}\n");
+    print("%2kids[j] = k;\n");
+    print("%2nts[j] = s[n];\n");
+    print("%1}\n");
+    print("%1nts[n] = 0;\n");
+    print("}\n\n");
+}
+
+/* initialize the costs to max */
+static void emit_init_costs(void)
+{
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        select_model(m);
+        for (int i = 1; i <= num_nonterms; i++)
+            print("%1p->costs%s[%d] =\n", mcol(), i);
+    }
+    select_model(0);
+    print("%20x%x;\n\n", MAX_COST);
+}
+
 /*
   ?trace(t, ruleno, cost, bestcost);
+  or with -ring:
+  if (?trace_on)
+      ?trace_record(t, NODE_OP(t), ruleno, ?xx_NT, cost, bestcost);
   if (c + cost < p->costs[?xx_NT]) {
       p->costs[?xx_NT] = c + cost;
       p->rule.xx = r->irn;
+      p->derive[?xx_NT / 32] |= 1 << ?xx_NT % 32;
       ?closure_xx(t, c + cost);
   }
  */
 static void emit_record(char *tabs, struct rule *r, char *c, int cost)
 {
-    if (trace)
-        print("%s%?trace(t, %d, %s + %d, p->costs[%?%K_NT]);\n",
-              tabs, r->ern, c, cost, r->nterm);
-
-    print("%sif (%s + %d < p->costs[%?%K_NT]) {\n", tabs, c, cost, r->nterm);
-    print("%s%1p->costs[%?%K_NT] = %s + %d;\n", tabs, r->nterm, c, cost);
-    print("%s%1p->rule.%K = %d;\n", tabs, r->nterm, r->irn);
+    char *m = mcol();
+
+    if (ring)
+        print("%sif (%?trace_on)\n%s%1%?trace_record(%s, %s, %d, %?%K_NT, %s + %d, p->costs%s[%?%K_NT]);\n",
+              tabs, tabs, node_expr("t"), op_expr("t"), r->ern, r->nterm, c, cost, mcol(), r->nterm);
+    else if (trace)
+        print("%s%?trace(%s, %d, %s + %d, p->costs%s[%?%K_NT]);\n",
+              tabs, node_expr("t"), r->ern, c, cost, mcol(), r->nterm);
+
+    print("%sif (%s + %d < p->costs%s[%?%K_NT]) {\n", tabs, c, cost, m, r->nterm);
+    print("%s%1p->costs%s[%?%K_NT] = %s + %d;\n", tabs, m, r->nterm, c, cost);
+    print("%s%1p->rule%s.%K = %d;\n", tabs, m, r->nterm, r->irn);
+    print("%s%1p->derive%s[%d] |= 0x%x;\n", tabs, m,
+          r->nterm->number / 32, 1u << r->nterm->number % 32);
+    if (need)
+        print("%s%1p->need%s[%?%K_NT] = %s;\n", tabs, m, r->nterm, need_expr(r));
     if (r->nterm->chain)
-        print("%s%1%?closure_%K(t, %s + %d);\n", tabs, r->nterm, c, cost);
+        print("%s%1%?closure_%K%s(%st, %s + %d);\n", tabs, r->nterm, msuffix(),
+              extra_args(), c, cost);
     print("%s}\n", tabs);
 }
 
@@ -542,140 +1175,358 @@ static void emit_record(char *tabs, struct rule *r, char *c, int cost)
       ... emit closure part ...
   }
  */
-static void emit_func_closure(struct nonterm *nt)
+static void emit_func_closure_model(struct nonterm *nt)
 {
-    assert(nt->chain);
-
-    print("static void %?closure_%K(%s *t, int c)\n", nt, NODE_TYPE);
+    emit_head("void");
+    print("%?closure_%K%s(%s%s, int c)\n", nt, msuffix(), extra_params(), node_param("t"));
     print("{\n");
-    print("%1struct %?state *p = (struct %?state *)%s(t);\n", NODE_STATE);
+    print("%1struct %?state *p = %s;\n", state_expr("t"));
+    if (ring)
+        print("\n%1%?trace_depth++;\n");
     for (struct rule *r = nt->chain; r; r = r->chain) {
         print("%1/* %d. %R */\n", r->ern, r);
         if (r->cost == -1) {
-            print("%1c += %s;\n", r->code);
+            print("%1c += %s;\n", dyn_code(r));
             emit_record("\t", r, "c", 0);
         } else {
             emit_record("\t", r, "c", r->cost);
         }
     }
+    if (ring)
+        print("%1%?trace_depth--;\n");
     print("}\n\n");
 }
 
-/* emit the matched condition */
-static void emit_cond(struct pattern *p, char *var, char *suffix)
+/* one closure of `nt' per cost model */
+static void emit_func_closure(struct nonterm *nt)
 {
-    struct term *t = p->op;
-    
-    if (t->kind == TERM) {
-        print("%3%s(%s) == %d%s/* %K */",
-              NODE_OP, var, t->id, p->nterms > 1 ? " && " : suffix, t);
+    assert(nt->chain);
+
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        select_model(m);
+        emit_func_closure_model(nt);
+    }
+    select_model(0);
+}
+
+/* emit the matched conditions of the kids of `p', one per line */
+static void emit_cond(char *tabs, struct pattern *p, char *var, int *n)
+{
+    for (int i = 0; i < p->nkids; i++) {
+        struct pattern *k = p->kids[i];
+        struct term *t = k->op;
+        char *sub = kid_expr(var, i);
+
+        if (t->kind == TERM) {
+            print("%s%s == %d%s/* %K */\n", tabs, op_expr(sub), t->id,
+                  --*n ? " && " : " ", t);
+            emit_cond(tabs, k, sub, n);
+        }
+    }
+}
+
+/*
+  emit the derivable tests of nonterm leaves of the kids of `p', one per
+  line, so rules whose kids can't derive their nonterms are rejected
+  before loading any cost
+ */
+static void emit_derive(char *tabs, struct pattern *p, char *var, int *n)
+{
+    for (int i = 0; i < p->nkids; i++) {
+        struct pattern *k = p->kids[i];
+        struct nonterm *nt = k->op;
+        char *sub = kid_expr(var, i);
 
-        if (p->left)
-            emit_cond(p->left, format("%s(%s)", LEFT_KID, var),
-                      p->right && p->right->nterms ? " && " : suffix);
-        if (p->right)
-            emit_cond(p->right, format("%s(%s)", RIGHT_KID, var), suffix);
+        if (nt->kind == TERM)
+            emit_derive(tabs, k, sub, n);
+        else
+            print("%s%s->derive%s[%d] & 0x%x%s/* %K */\n",
+                  tabs, state_expr(sub), mcol(), nt->number / 32, 1u << nt->number % 32,
+                  --*n ? " && " : " ", nt);
     }
 }
 
+/* emit the costs of nonterm leaves of the kids of `p' */
 static void emit_cost(struct pattern *p, char *var)
 {
-    struct term *t = p->op;
-    
-    if (t->kind == TERM) {
-        if (p->left)
-            emit_cost(p->left, format("%s(%s)", LEFT_KID, var));
-        if (p->right)
-            emit_cost(p->right, format("%s(%s)", RIGHT_KID, var));
-    } else {
-        print("((struct %?state *)(%s(%s)))->costs[%?%K_NT] + ",
-              NODE_STATE, var, t);
+    for (int i = 0; i < p->nkids; i++) {
+        struct pattern *k = p->kids[i];
+        struct term *t = k->op;
+        char *sub = kid_expr(var, i);
+
+        if (t->kind == TERM)
+            emit_cost(k, sub);
+        else
+            print("%s->costs%s[%?%K_NT] + ", state_expr(sub), mcol(), t);
     }
 }
 
-static void emit_case(struct term *t)
+/* label the kids of `t' */
+static void emit_case_kids(struct term *t)
 {
-    /* case op: */
-    print("%1case %d: /* %K */\n", t->id, t);
-    switch (t->nkids) {
-    case 0:
-    case -1:
-        /*
-          do nothing
-          terminals never appeared in a pattern
-          would have the default nkids -1.
-         */
-        break;
-    case 1:
-        print("%2assert(l);\n");
-        print("%2%?label(l);\n");
-        break;
-    case 2:
-        print("%2assert(l && r);\n");
-        print("%2%?label(l);\n");
-        print("%2%?label(r);\n");
-        break;
-    default:
-        assert(0 && "illegal nkids");
+    /*
+      terminals never appeared in a pattern
+      would have the default nkids -1.
+     */
+    if (array) {
+        /* post-order, kids are labeled */
+        for (int i = 0; i < t->nkids; i++)
+            print("%2assert(%s < t);\n", kid_expr("t", i));
+        return;
     }
+    for (int i = 0; i < t->nkids; i++)
+        print("%2assert(%s);\n", kid_expr("t", i));
+    for (int i = 0; i < t->nkids; i++)
+        print("%2%?label(%s%s);\n", extra_args(), kid_expr("t", i));
+}
+
+/* match and record the rules of `t' for the cost model being emitted */
+static void emit_case_rules_model(struct term *t)
+{
     /* walk terminal links */
     for (struct rule *r = t->rules; r; r = r->tlink) {
         char *tabs = "\t\t";
         print("%2/* %d. %R */\n", r->ern, r);
-        switch (t->nkids) {
-        case 0:
-        case -1:
+        if (t->nkids <= 0) {
             if (r->cost == -1) {
-                print("%2c = %s;\n", r->code);
+                print("%2c = %s;\n", dyn_code(r));
                 emit_record(tabs, r, "c", 0);
             } else {
                 emit_record(tabs, r, r->code, 0);
             }
-            break;
-        case 1:
-            if (r->pattern->nterms > 1) {
-                /* sub-tree pattern is a terminal */
-                print("%2if (\n");
-                emit_cond(r->pattern->left, "l", " ");
-                print("\n%2) {\n");
-                print("%3c = ");
-                tabs = "\t\t\t";
-            } else {
-                print("%2c = ");
-            }
-            emit_cost(r->pattern->left, "l");
-            print("%s;\n", r->code);
-            emit_record(tabs, r, "c", 0);
-            if (tabs[2])        /* end if */
-                print("%2}\n");
-            break;
-        case 2:
-            if (r->pattern->nterms > 1) {
-                /* sub-tree patterns have terminal */
-                print("%2if (\n");
-                emit_cond(r->pattern->left, "l",
-                          r->pattern->right->nterms ? " && " : " ");
-                emit_cond(r->pattern->right, "r", " ");
-                print("\n%2) {\n");
-                print("%3c = ");
-                tabs = "\t\t\t";
-            } else {
-                print("%2c = ");
-            }
-            emit_cost(r->pattern->left, "l");
-            emit_cost(r->pattern->right, "r");
-            print("%s;\n", r->code);
-            emit_record(tabs, r, "c", 0);
-            if (tabs[2])        /* end if */
-                print("%2}\n");
-            break;
-        default:
-            assert(0 && "illegal nkids");
+            continue;
         }
+        if (r->pattern->nterms > 1 || count_nts(r->pattern)) {
+            /* sub-tree patterns have terminal, then nonterm leaves */
+            int n = r->pattern->nterms - 1 + count_nts(r->pattern);
+            print("%2if (\n");
+            emit_cond("\t\t\t", r->pattern, "t", &n);
+            emit_derive("\t\t\t", r->pattern, "t", &n);
+            print("%2) {\n");
+            print("%3c = ");
+            tabs = "\t\t\t";
+        } else {
+            print("%2c = ");
+        }
+        emit_cost(r->pattern, "t");
+        print("%s;\n", dyn_code(r));
+        emit_record(tabs, r, "c", 0);
+        if (tabs[2])        /* end if */
+            print("%2}\n");
+    }
+}
+
+/* match and record the rules of `t', kids are labeled */
+static void emit_case_rules(struct term *t)
+{
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        select_model(m);
+        if (num_models > 1 && t->rules)
+            print("%2/* %s */\n", model_names[m]);
+        emit_case_rules_model(t);
+    }
+    select_model(0);
+}
+
+/*
+  With -context, the states of the kids the rules of `t' read are looked
+  up once, before the rules are matched:
+
+      kids[0] = ?ctx_get(ctx, KID(t, 0));
+ */
+static void emit_case_ctx_kids(struct term *t)
+{
+    for (int i = 0; i < t->nkids; i++) {
+        struct rule *r;
+
+        for (r = t->rules; r; r = r->tlink)
+            if (((struct term *)r->pattern->kids[i]->op)->kind == NONTERM)
+                break;
+        if (r)
+            print("%2kids[%d] = %?ctx_get(ctx, %s);\n", i, kid_expr("t", i));
     }
+}
+
+static void emit_case(struct term *t)
+{
+    /* case op: */
+    print("%1case %d: /* %K */\n", t->id, t);
+    emit_case_kids(t);
+    if (ctx_kids)
+        emit_case_ctx_kids(t);
+    emit_case_rules(t);
     print("%2break;\n");
 }
 
+/*
+  Constant leaf states (-const).
+
+  A leaf whose rules, and the chain rules they reach, all have literal
+  costs is labeled alike every time. Its labeling is run here, per cost
+  model, and emitted as a constant state:
+
+  static const struct ?state ?leaf_xx = {
+      { costs },
+      { derive },
+      { needs },                  // with -need
+      { rules },
+  };
+
+  ?label points NODE_STATE at it instead of allocating, so the states
+  of these leaves are shared and must not be freed or written. Not with
+  -T or -ring, which trace each labeling, nor with the labelers that
+  keep their states elsewhere (-split, -cxx, -share, -array, -context).
+  ?label1 (-parallel) and ?label_batch (-batch) still label all leaves.
+ */
+struct leaf {
+    int *costs;                 /* indexed by nonterm number */
+    int *derive;                /* bit n for nonterm n */
+    int *needs;
+    int *rules;                 /* inner rule numbers */
+};
+
+static char *closure_used;        /* closures called, all if NULL */
+
+/* `nt' has a closure and it's called */
+static int has_closure(struct nonterm *nt)
+{
+    return nt->chain && (!closure_used || closure_used[nt->number]);
+}
+
+static void mark_closure(struct nonterm *nt)
+{
+    if (closure_used[nt->number])
+        return;
+    closure_used[nt->number] = 1;
+    for (struct rule *r = nt->chain; r; r = r->chain)
+        mark_closure(r->nterm);
+}
+
+static int leaf_record(struct leaf *l, struct rule *r, int c);
+
+/* ?closure_xx, 0 if a chain rule has a dynamic cost */
+static int leaf_closure(struct leaf *l, struct nonterm *nt, int c)
+{
+    for (struct rule *r = nt->chain; r; r = r->chain)
+        if (r->cost == -1 || !leaf_record(l, r, c + r->cost))
+            return 0;
+    return 1;
+}
+
+/* see emit_record */
+static int leaf_record(struct leaf *l, struct rule *r, int c)
+{
+    struct nonterm *nt = r->nterm;
+    struct nonterm *rhs = r->pattern->op;
+
+    if (c >= l->costs[nt->number])
+        return 1;
+    l->costs[nt->number] = c;
+    l->rules[nt->number] = r->irn;
+    l->derive[nt->number / 32] |= 1u << nt->number % 32;
+    /* see need_expr */
+    l->needs[nt->number] = rule_regs(r);
+    if (rhs->kind == NONTERM && l->needs[rhs->number] > rule_regs(r))
+        l->needs[nt->number] = l->needs[rhs->number];
+    return !nt->chain || leaf_closure(l, nt, c);
+}
+
+/* find the leaves with constant states */
+static void build_leaves(void)
+{
+    int models = num_models > 1 ? num_models : 1;
+
+    for (struct term *t = terms; t; t = t->link) {
+        struct leaf *l;
+        int ok = 1;
+
+        if (t->nkids > 0)
+            continue;
+        l = NEWARRAY(sizeof(struct leaf), models);
+        for (int m = 0; ok && m < models; m++) {
+            select_model(m);
+            l[m].costs = NEWARRAY(sizeof(int), num_nonterms + 1);
+            l[m].derive = NEWARRAY(sizeof(int), num_nonterms / 32 + 1);
+            l[m].rules = NEWARRAY(sizeof(int), num_nonterms + 1);
+            l[m].needs = NEWARRAY(sizeof(int), num_nonterms + 1);
+            for (int i = 1; i <= num_nonterms; i++)
+                l[m].costs[i] = MAX_COST;
+            for (struct rule *r = t->rules; ok && r; r = r->tlink)
+                ok = r->cost != -1 && leaf_record(&l[m], r, r->cost);
+        }
+        select_model(0);
+        if (ok)
+            t->leaf = l;
+    }
+
+    /* closures only called by constant leaves are left out */
+    closure_used = NEWARRAY(1, num_nonterms + 1);
+    for (struct term *t = terms; t; t = t->link)
+        if (!t->leaf || parallel)   /* ?label1 labels all ops */
+            for (struct rule *r = t->rules; r; r = r->tlink)
+                mark_closure(r->nterm);
+}
+
+static int *leaf_values(struct leaf *l, const char *field)
+{
+    return !strcmp(field, "costs") ? l->costs : !strcmp(field, "derive") ? l->derive :
+        !strcmp(field, "need") ? l->needs : l->rules;
+}
+
+/* `{ v[first..last] }, // field' of ?leaf_xx, a `{ }' per cost model if several */
+static void emit_leaf_field(struct term *t, const char *field, int first, int last)
+{
+    const char *fmt = strcmp(field, "costs") && strcmp(field, "derive") ? "%s%d" : "%s0x%x";
+
+    print("%1{");
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        int *v = leaf_values(&t->leaf[m], field);
+
+        if (num_models > 1)
+            print("%s{", m ? ", " : " ");
+        for (int i = first; i <= last; i++)
+            print(fmt, i > first ? ", " : " ", v[i]);
+        if (num_models > 1)
+            print(" }");
+    }
+    print(" }, // %s\n", field);
+}
+
+static void emit_var_leaves(void)
+{
+    for (struct term *t = terms; t; t = t->link) {
+        if (!t->leaf)
+            continue;
+        print("static const struct %?state %?leaf_%K = {\n", t);
+        emit_leaf_field(t, "costs", 0, num_nonterms);
+        emit_leaf_field(t, "derive", 0, num_nonterms / 32);
+        if (need)
+            emit_leaf_field(t, "need", 0, num_nonterms);
+        emit_leaf_field(t, "rule", 1, num_nonterms);
+        print("};\n\n");
+    }
+}
+
+/* point NODE_STATE at ?leaf_xx for constant leaves */
+static void emit_label_leaves(void)
+{
+    int n = 0;
+
+    for (struct term *t = terms; t; t = t->link)
+        n += t->leaf != NULL;
+    if (n == 0)
+        return;
+    print("%1switch (%s) {\n", op_expr("t"));
+    for (struct term *t = terms; t; t = t->link) {
+        if (!t->leaf)
+            continue;
+        print("%1case %d: /* %K */\n", t->id, t);
+        print("%2%s(t) = (void *)&%?leaf_%K;\n", NODE_STATE, t);
+        print("%2return;\n");
+    }
+    print("%1}\n\n");
+}
+
 /*
   Function: ?label(NODE_TYPE *t)
 
@@ -693,13 +1544,10 @@ static void emit_case(struct term *t)
   static void ?label(NODE_TYPE *t)
   {
       int c;
-      NODE_TYPE *l, *r;
       struct ?state *p;
  
       assert(t && "null tree");
  
-      l = LEFT_KID(t);
-      r = RIGHT_KID(t);
       NODE_STATE(t) = p = ?ZNEW(sizeof(struct ?state));
  
       p->costs[1] =
@@ -717,48 +1565,1404 @@ static void emit_case(struct term *t)
  */
 static void emit_func_label(void)
 {
-    print("static void %?label(%s *t)\n", NODE_TYPE);
+    emit_head("void");
+    print("%?label(%s%s *t)\n", extra_params(), node_type);
     print("{\n");
 
-    print("%1int c;\n");
-    print("%1%s *l, *r;\n", NODE_TYPE);
-    print("%1struct %?state *p;\n\n");
+    if (!split)
+        print("%1int c;\n");
+    if (context && max_kids > 0)
+        print("%1struct %?state *p, *kids[%d];\n\n", max_kids);
+    else
+        print("%1struct %?state *p;\n\n");
     print("%1assert(t && \"%s\");\n\n", "null tree");
-    print("%1l = %s(t);\n", LEFT_KID);
-    print("%1r = %s(t);\n", RIGHT_KID);
-    print("%1%s(t) = p = %?ZNEW(sizeof(struct %?state));\n\n", NODE_STATE);
+    if (cxx)
+        print("%1Traits::state(t) = p = Traits::new_state();\n\n");
+    else if (context)
+        print("%1%?ctx_put(ctx, t, p = %?ZNEW(sizeof(struct %?state)));\n\n");
+    else {
+        emit_label_leaves();
+        print("%1%s(t) = p = %?ZNEW(sizeof(struct %?state));\n\n", NODE_STATE);
+    }
 
     /* initialize the cost to max */
-    for (int i = 1; i <= num_nonterms; i++)
-        print("%1p->costs[%d] =\n", i);
-    print("%20x%x;\n\n", MAX_COST);
+    emit_init_costs();
 
-    print("%1switch (%s(t)) {\n", NODE_OP);
+    print("%1switch (%s) {\n", op_expr("t"));
     /* cases */
+    if (split) {
+        for (int i = 0; i < split; i++) {
+            int n = 0;
+            for (struct term *t = terms; t; t = t->link)
+                if (t->part == i && ++n)
+                    print("%1case %d: /* %K */\n", t->id, t);
+            if (n) {
+                print("%2%?label_%d(t, p);\n", i);
+                print("%2break;\n");
+            }
+        }
+    } else {
+        ctx_kids = context;
+        for (struct term *t = terms; t; t = t->link)
+            if (!t->leaf)
+                emit_case(t);
+        ctx_kids = 0;
+    }
+    print("%1default:\n");
+    print("%2abort();\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
+/*
+  ?label with -array, see also: emit_func_label
+
+  static void ?label_node(NODE_TYPE *nodes, struct ?state *states, int t)
+  {
+      int c;
+      struct ?state *p = &states[t];
+
+      memset(p, 0, sizeof(*p));
+      ... initialize costs to MAX_COST ...
+      switch (NODE_OP(&nodes[t])) {
+      ... emit cases, kids are labeled ...
+      default:
+          abort();
+      }
+  }
+
+  static void ?label_array(NODE_TYPE *nodes, struct ?state *states, int n)
+  {
+      for (int t = 0; t < n; t++)
+          ?label_node(nodes, states, t);
+  }
+ */
+/*
+  Dynamic costs with -array.
+
+  The cost code is written against nodes, so each one is evaluated by a
+  function where `t' is the node and KID, unless defined, indexes
+  `nodes' with KID_INDEX:
+
+  #ifndef KID
+  #define KID(p, i) (&nodes[KID_INDEX(p, i)])
+  #endif
+
+  static int ?cost_ern(NODE_TYPE *nodes, NODE_TYPE *t)
+  {
+      return code;
+  }
+
+  and the rules call ?cost_ern(nodes, &nodes[t]).
+ */
+static void emit_array_costs(void)
+{
+    int n = 0;
+
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        select_model(m);
+        for (struct rule *r = rules; r; r = r->link) {
+            char *call;
+
+            if (r->cost != -1)
+                continue;
+            if (n++ == 0) {
+                print("#ifndef %s\n", KID);
+                print("#define %s(p, i) (&nodes[%s(p, i)])\n", KID, KID_INDEX);
+                print("#endif\n\n");
+            }
+            print("/* %d. %R */\n", r->ern, r);
+            print("static int %?cost_%d%s(%s *nodes, %s *t)\n", r->ern, msuffix(),
+                  node_type, node_type);
+            print("{\n");
+            print("%1(void)nodes;\n");
+            print("%1return %s;\n", r->code);
+            print("}\n\n");
+            call = format("%scost_%d%s(nodes, &nodes[t])", prefix, r->ern, msuffix());
+            r->code = call;
+            if (num_models > 1)
+                r->codes[m] = call;
+        }
+    }
+    select_model(0);
+}
+
+static void emit_func_label_array(void)
+{
+    print("static void %?label_node(%sint t)\n", extra_params());
+    print("{\n");
+    print("%1int c;\n");
+    print("%1struct %?state *p = &states[t];\n\n");
+    print("%1memset(p, 0, sizeof(*p));\n");
+    emit_init_costs();
+    print("%1switch (%s) {\n", op_expr("t"));
     for (struct term *t = terms; t; t = t->link)
         emit_case(t);
     print("%1default:\n");
     print("%2abort();\n");
     print("%1}\n");
     print("}\n\n");
+
+    print("static void %?label_array(%sint n)\n", extra_params());
+    print("{\n");
+    print("%1assert(nodes && states && \"%s\");\n\n", "null tree");
+    print("%1for (int t = 0; t < n; t++)\n");
+    print("%2%?label_node(nodes, states, t);\n");
+    print("}\n\n");
+}
+
+/*
+  Parallel labeling (-parallel).
+
+  ?plabel(t, nthreads) labels a large tree on a pool of threads. A plan
+  pass measures the subtrees, with NODE_SIZE(p) if defined or by
+  counting. Nodes whose subtree has at least ?PAR_THRESHOLD nodes are
+  labeled by their own task (?label1) after all kid tasks are done; the
+  smaller kids of such nodes are labeled sequentially by ?label as one
+  task each. The subtree tasks are dealt to the per-thread deques and
+  stolen by idle threads; the thread that completes the last kid of a
+  node goes on with the node, so no task is queued after the plan and
+  a thread is done when all deques are empty.
+
+  States are allocated by ?ZNEW from several threads.
+ */
+static void emit_func_nkids(void)
+{
+    print("static int %?nkids(int op)\n");
+    print("{\n");
+    print("%1switch (op) {\n");
+    for (struct term *t = terms; t; t = t->link)
+        if (t->nkids > 0)
+            print("%1case %d: return %d; /* %K */\n", t->id, t->nkids, t);
+    print("%1default: return 0;\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
+/* ?label1(t): ?label without labeling the kids */
+static void emit_func_label1(void)
+{
+    print("static void %?label1(%s *t)\n", node_type);
+    print("{\n");
+    print("%1int c;\n");
+    print("%1struct %?state *p;\n\n");
+    print("%1%s(t) = p = %?ZNEW(sizeof(struct %?state));\n\n", NODE_STATE);
+    emit_init_costs();
+    print("%1switch (%s) {\n", op_expr("t"));
+    for (struct term *t = terms; t; t = t->link) {
+        print("%1case %d: /* %K */\n", t->id, t);
+        emit_case_rules(t);
+        print("%2break;\n");
+    }
+    print("%1default:\n");
+    print("%2abort();\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
+static void emit_func_parallel(void)
+{
+    emit_func_nkids();
+    emit_func_label1();
+
+    print("struct %?ptask {\n");
+    print("%1%s *node;\n", node_type);
+    print("%1struct %?ptask *parent;\n");
+    print("%1struct %?ptask *next;           /* all tasks */\n");
+    print("%1int pending;                   /* kid tasks not done */\n");
+    print("%1int subtree;                   /* labeled by ?label */\n");
+    print("};\n\n");
+    print("struct %?pworker {\n");
+    print("%1pthread_mutex_t lock;\n");
+    print("%1struct %?ptask **tasks;\n");
+    print("%1int top, bottom, cap;\n");
+    print("%1struct %?ppool *pool;\n");
+    print("%1pthread_t thread;\n");
+    print("};\n\n");
+    print("struct %?ppool {\n");
+    print("%1struct %?pworker *workers;\n");
+    print("%1int nworkers;\n");
+    print("%1int deal;\n");
+    print("%1struct %?ptask *tasks;\n");
+    print("};\n\n");
+
+    /* new task */
+    print("static struct %?ptask *%?ptask_new(struct %?ppool *pool, %s *t, int subtree)\n", node_type);
+    print("{\n");
+    print("%1struct %?ptask *task = calloc(1, sizeof(struct %?ptask));\n\n");
+    print("%1task->node = t;\n");
+    print("%1task->subtree = subtree;\n");
+    print("%1task->next = pool->tasks;\n");
+    print("%1pool->tasks = task;\n");
+    print("%1return task;\n");
+    print("}\n\n");
+
+    /* deal a ready task, before the threads start */
+    print("static void %?pdeal(struct %?ppool *pool, struct %?ptask *task)\n");
+    print("{\n");
+    print("%1struct %?pworker *w = &pool->workers[pool->deal++ %% pool->nworkers];\n\n");
+    print("%1if (w->bottom == w->cap) {\n");
+    print("%2w->cap = w->cap ? w->cap * 2 : 64;\n");
+    print("%2w->tasks = realloc(w->tasks, w->cap * sizeof(struct %?ptask *));\n");
+    print("%1}\n");
+    print("%1w->tasks[w->bottom++] = task;\n");
+    print("}\n\n");
+
+    /* plan */
+    print("static struct %?ptask *%?plan(struct %?ppool *pool, %s *t, long *size)\n", node_type);
+    print("{\n");
+    print("%1struct %?ptask *task, *kids[%d];\n", max_kids > 0 ? max_kids : 1);
+    print("%1int nkids = %?nkids(%s);\n", op_expr("t"));
+    print("%1long n = 1, s;\n\n");
+    print("#ifdef NODE_SIZE\n");
+    print("%1if ((*size = NODE_SIZE(t)) < %?PAR_THRESHOLD)\n");
+    print("%2return NULL;\n");
+    print("#endif\n");
+    print("%1for (int i = 0; i < nkids; i++) {\n");
+    print("%2kids[i] = %?plan(pool, %s, &s);\n", kid_expr_at("t", "i"));
+    print("%2n += s;\n");
+    print("%1}\n");
+    print("%1*size = n;\n");
+    print("%1if (n < %?PAR_THRESHOLD)\n");
+    print("%2return NULL;\n");
+    print("%1task = %?ptask_new(pool, t, 0);\n");
+    print("%1task->pending = nkids;\n");
+    print("%1for (int i = 0; i < nkids; i++) {\n");
+    print("%2if (!kids[i]) {\n");
+    print("%3kids[i] = %?ptask_new(pool, %s, 1);\n", kid_expr_at("t", "i"));
+    print("%3%?pdeal(pool, kids[i]);\n");
+    print("%2}\n");
+    print("%2kids[i]->parent = task;\n");
+    print("%1}\n");
+    print("%1if (nkids == 0)\n");
+    print("%2%?pdeal(pool, task);\n");
+    print("%1return task;\n");
+    print("}\n\n");
+
+    /* run a task, then its parents while this is the last kid done */
+    print("static void %?prun(struct %?ptask *task)\n");
+    print("{\n");
+    print("%1for (;;) {\n");
+    print("%2if (task->subtree)\n");
+    print("%3%?label(task->node);\n");
+    print("%2else\n");
+    print("%3%?label1(task->node);\n");
+    print("%2task = task->parent;\n");
+    print("%2if (!task || %?ATOMIC_DEC(&task->pending))\n");
+    print("%3break;\n");
+    print("%1}\n");
+    print("}\n\n");
+
+    /* own tasks are taken from the bottom, stolen ones from the top */
+    print("static struct %?ptask *%?ptake(struct %?pworker *w, int steal)\n");
+    print("{\n");
+    print("%1struct %?ptask *task = NULL;\n\n");
+    print("%1pthread_mutex_lock(&w->lock);\n");
+    print("%1if (w->top < w->bottom)\n");
+    print("%2task = steal ? w->tasks[w->top++] : w->tasks[--w->bottom];\n");
+    print("%1pthread_mutex_unlock(&w->lock);\n");
+    print("%1return task;\n");
+    print("}\n\n");
+
+    print("static void *%?pwork(void *arg)\n");
+    print("{\n");
+    print("%1struct %?pworker *w = arg;\n");
+    print("%1struct %?ppool *pool = w->pool;\n");
+    print("%1struct %?ptask *task;\n");
+    print("%1int i, self = w - pool->workers;\n\n");
+    print("%1for (;;) {\n");
+    print("%2if ((task = %?ptake(w, 0)) == NULL) {\n");
+    print("%3for (i = 1; i < pool->nworkers; i++)\n");
+    print("%4if ((task = %?ptake(&pool->workers[(self + i) %% pool->nworkers], 1)))\n");
+    print("%5break;\n");
+    print("%3if (!task)\n");
+    print("%4return NULL;\n");
+    print("%2}\n");
+    print("%2%?prun(task);\n");
+    print("%1}\n");
+    print("}\n\n");
+
+    /* entry */
+    print("static void %?plabel(%s *t, int nthreads)\n", node_type);
+    print("{\n");
+    print("%1struct %?ppool pool;\n");
+    print("%1struct %?ptask *task;\n");
+    print("%1long size;\n\n");
+    print("%1assert(t && \"%s\");\n", "null tree");
+    print("%1assert(nthreads > 0);\n\n");
+    print("%1memset(&pool, 0, sizeof(pool));\n");
+    print("%1pool.nworkers = nthreads;\n");
+    print("%1pool.workers = calloc(nthreads, sizeof(struct %?pworker));\n");
+    print("%1for (int i = 0; i < nthreads; i++) {\n");
+    print("%2pthread_mutex_init(&pool.workers[i].lock, NULL);\n");
+    print("%2pool.workers[i].pool = &pool;\n");
+    print("%1}\n\n");
+    print("%1if (nthreads == 1 || !%?plan(&pool, t, &size)) {\n");
+    print("%2%?label(t);\n");
+    print("%1} else {\n");
+    print("%2for (int i = 1; i < nthreads; i++)\n");
+    print("%3if (pthread_create(&pool.workers[i].thread, NULL, %?pwork, &pool.workers[i]))\n");
+    print("%4abort();\n");
+    print("%2%?pwork(&pool.workers[0]);\n");
+    print("%2for (int i = 1; i < nthreads; i++)\n");
+    print("%3pthread_join(pool.workers[i].thread, NULL);\n");
+    print("%1}\n\n");
+    print("%1while ((task = pool.tasks)) {\n");
+    print("%2pool.tasks = task->next;\n");
+    print("%2free(task);\n");
+    print("%1}\n");
+    print("%1for (int i = 0; i < nthreads; i++) {\n");
+    print("%2pthread_mutex_destroy(&pool.workers[i].lock);\n");
+    print("%2free(pool.workers[i].tasks);\n");
+    print("%1}\n");
+    print("%1free(pool.workers);\n");
+    print("}\n\n");
+}
+
+/*
+  Batch labeling (-batch).
+
+  ?label_batch(trees, n) labels the `n' trees of `trees' at once and
+  returns the block of their states, a single ?ZNEW to be freed by the
+  caller. The nodes are grouped by height and op, so the nodes of a
+  group don't depend on each other and their kids are labeled by the
+  groups before. Each group is labeled ?BATCH_WIDTH nodes at a time with
+  the costs and rules in structure-of-arrays form:
+
+  struct ?batch {
+      NODE_TYPE *t[?BATCH_WIDTH];
+      short costs[?NUM_NTS + 1][?BATCH_WIDTH];
+      short rule[?NUM_NTS + 1][?BATCH_WIDTH];
+  };
+
+  A rule is matched for all lanes into a cost and a mask, then recorded
+  with blends, so the compares and updates run across the lanes:
+
+  for (j = 0; j < w; j++) {
+      NODE_TYPE *t = b->t[j];
+      c[j] = ... cost ...;
+      m[j] = c[j] < b->costs[?xx_NT][j];
+  }
+  if (?batch_record(b->costs[?xx_NT], b->rule[?xx_NT], c, m, r->irn, w))
+      ?bclosure_xx(b, w, c, m);
+
+  Rules with literal costs and nonterm kids skip the derive tests, the
+  costs of underivable nonterms are MAX_COST and fail the compare alone.
+  Other rules test their kids first, as ?label does. Each lane sees the
+  rules and chain rules in the order of ?label, so the selected rules
+  are the same.
+ */
+
+/* the lanes of `c' and `m' for `r' in ?label_batch */
+static void emit_batch_rule(struct term *t, struct rule *r)
+{
+    int guard = t->nkids > 0 && (r->pattern->nterms > 1 || r->cost < 0);
+
+    print("%2/* %d. %R */\n", r->ern, r);
+    print("%2for (j = 0; j < w; j++) {\n");
+    if (t->nkids > 0 || r->cost == -1)
+        print("%3%s *t = b->t[j];\n", node_type);
+    if (guard) {
+        int n = r->pattern->nterms - 1 + count_nts(r->pattern);
+        print("%3c[j] = 0;\n");
+        print("%3m[j] = 0;\n");
+        print("%3if (\n");
+        emit_cond("\t\t\t\t", r->pattern, "t", &n);
+        emit_derive("\t\t\t\t", r->pattern, "t", &n);
+        print("%3) {\n");
+        print("%4c[j] = ");
+        emit_cost(r->pattern, "t");
+        print("%s;\n", r->code);
+        print("%4m[j] = c[j] < b->costs[%?%K_NT][j];\n", r->nterm);
+        print("%3}\n");
+    } else {
+        print("%3c[j] = ");
+        emit_cost(r->pattern, "t");
+        print("%s;\n", r->code);
+        print("%3m[j] = c[j] < b->costs[%?%K_NT][j];\n", r->nterm);
+    }
+    print("%2}\n");
+    print("%2%s%?batch_record(b->costs[%?%K_NT], b->rule[%?%K_NT], c, m, %d, w)%s\n",
+          r->nterm->chain ? "if (" : "", r->nterm, r->nterm, r->irn,
+          r->nterm->chain ? ")" : ";");
+    if (r->nterm->chain)
+        print("%3%?bclosure_%K(b, w, c, m);\n", r->nterm);
+}
+
+/* ?bclosure_xx(b, w, c, m): ?closure_xx for the lanes of `m' */
+static void emit_batch_closure(struct nonterm *nt)
+{
+    print("static void %?bclosure_%K(struct %?batch *b, int w, int *c, const unsigned char *m)\n", nt);
+    print("{\n");
+    print("%1int nc[%?BATCH_WIDTH];\n");
+    print("%1unsigned char nm[%?BATCH_WIDTH];\n");
+    print("%1int j;\n\n");
+    for (struct rule *r = nt->chain; r; r = r->chain) {
+        print("%1/* %d. %R */\n", r->ern, r);
+        print("%1for (j = 0; j < w; j++) {\n");
+        if (r->cost == -1) {
+            print("%2if (m[j]) {\n");
+            print("%3%s *t = b->t[j];\n", node_type);
+            print("%3c[j] += %s;\n", r->code);
+            print("%2}\n");
+            print("%2nc[j] = c[j];\n");
+        } else {
+            print("%2nc[j] = c[j] + %d;\n", r->cost);
+        }
+        print("%2nm[j] = m[j] & (nc[j] < b->costs[%?%K_NT][j]);\n", r->nterm);
+        print("%1}\n");
+        print("%1%s%?batch_record(b->costs[%?%K_NT], b->rule[%?%K_NT], nc, nm, %d, w)%s\n",
+              r->nterm->chain ? "if (" : "", r->nterm, r->nterm, r->irn,
+              r->nterm->chain ? ")" : ";");
+        if (r->nterm->chain)
+            print("%2%?bclosure_%K(b, w, nc, nm);\n", r->nterm);
+    }
+    print("}\n\n");
+}
+
+static void emit_func_batch(void)
+{
+    int n = 0;
+
+    assert(num_terms > 0);
+    emit_func_nkids();
+
+    print("struct %?batch {\n");
+    print("%1%s *t[%?BATCH_WIDTH];\n", node_type);
+    print("%1short costs[%?NUM_NTS + 1][%?BATCH_WIDTH];\n");
+    print("%1short rule[%?NUM_NTS + 1][%?BATCH_WIDTH];\n");
+    print("};\n\n");
+
+    print("struct %?bnode {\n");
+    print("%1%s *t;\n", node_type);
+    print("%1int key;                        /* height, then op */\n");
+    print("};\n\n");
+
+    /* dense op numbers */
+    print("static int %?batch_op(int op)\n");
+    print("{\n");
+    print("%1switch (op) {\n");
+    for (struct term *t = terms; t; t = t->link)
+        print("%1case %d: return %d; /* %K */\n", t->id, n++, t);
+    print("%1default: abort();\n");
+    print("%1}\n");
+    print("}\n\n");
+
+    /* record */
+    print("static int %?batch_record(short *costs, short *rule, const int *c,\n");
+    print("%3const unsigned char *m, int r, int w)\n");
+    print("{\n");
+    print("%1int any = 0;\n\n");
+    print("%1for (int j = 0; j < w; j++) {\n");
+    print("%2costs[j] = m[j] ? c[j] : costs[j];\n");
+    print("%2rule[j] = m[j] ? r : rule[j];\n");
+    print("%2any |= m[j];\n");
+    print("%1}\n");
+    print("%1return any;\n");
+    print("}\n\n");
+
+    /* closures */
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        if (nt->chain)
+            print("static void %?bclosure_%K(struct %?batch *b, int w, int *c, const unsigned char *m);\n", nt);
+    print("\n");
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        if (nt->chain)
+            emit_batch_closure(nt);
+
+    /* label the lanes, all of the same op */
+    print("static void %?batch_label(struct %?batch *b, int w)\n");
+    print("{\n");
+    print("%1int c[%?BATCH_WIDTH];\n");
+    print("%1unsigned char m[%?BATCH_WIDTH];\n");
+    print("%1int j;\n\n");
+    print("%1for (int i = 1; i <= %?NUM_NTS; i++) {\n");
+    print("%2for (j = 0; j < w; j++) {\n");
+    print("%3b->costs[i][j] = 0x%x;\n", MAX_COST);
+    print("%3b->rule[i][j] = 0;\n");
+    print("%2}\n");
+    print("%1}\n\n");
+    print("%1switch (%s) {\n", op_expr("b->t[0]"));
+    for (struct term *t = terms; t; t = t->link) {
+        print("%1case %d: /* %K */\n", t->id, t);
+        for (struct rule *r = t->rules; r; r = r->tlink)
+            emit_batch_rule(t, r);
+        print("%2break;\n");
+    }
+    print("%1default:\n");
+    print("%2abort();\n");
+    print("%1}\n");
+    print("}\n\n");
+
+    /* store the lanes */
+    print("static void %?batch_store(struct %?batch *b, struct %?state *s, int w)\n");
+    print("{\n");
+    print("%1for (int j = 0; j < w; j++) {\n");
+    print("%2struct %?state *p = &s[j];\n\n");
+    print("%2for (int i = 1; i <= %?NUM_NTS; i++) {\n");
+    print("%3p->costs[i] = b->costs[i][j];\n");
+    print("%3if (p->costs[i] < 0x%x)\n", MAX_COST);
+    print("%4p->derive[i / 32] |= 1u << i %% 32;\n");
+    print("%2}\n");
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        print("%2p->rule.%K = b->rule[%?%K_NT][j];\n", nt, nt);
+    print("%2%s(b->t[j]) = p;\n", NODE_STATE);
+    print("%1}\n");
+    print("}\n\n");
+
+    /* collect */
+    print("static int %?batch_count(%s *t)\n", node_type);
+    print("{\n");
+    print("%1int n = 1;\n\n");
+    print("%1assert(t && \"%s\");\n", "null tree");
+    print("%1for (int i = %?nkids(%s); i-- > 0; )\n", op_expr("t"));
+    print("%2n += %?batch_count(%s);\n", kid_expr_at("t", "i"));
+    print("%1return n;\n");
+    print("}\n\n");
+
+    print("/* append the nodes of `t' to `v' in post-order, returns the height of `t' */\n");
+    print("static int %?batch_collect(%s *t, struct %?bnode *v, int *n)\n", node_type);
+    print("{\n");
+    print("%1int h = 0;\n\n");
+    print("%1for (int i = 0, nkids = %?nkids(%s); i < nkids; i++) {\n", op_expr("t"));
+    print("%2int k = %?batch_collect(%s, v, n) + 1;\n", kid_expr_at("t", "i"));
+    print("%2if (k > h)\n");
+    print("%3h = k;\n");
+    print("%1}\n");
+    print("%1v[*n].t = t;\n");
+    print("%1v[(*n)++].key = h;\n");
+    print("%1return h;\n");
+    print("}\n\n");
+
+    /* entry */
+    print("static struct %?state *%?label_batch(%s **trees, int n)\n", node_type);
+    print("{\n");
+    print("%1struct %?batch b;\n");
+    print("%1struct %?bnode *v, *sorted;\n");
+    print("%1struct %?state *states;\n");
+    print("%1int *start, count = 0, height = 0, nkeys, i, k;\n\n");
+    print("%1if (n <= 0)\n");
+    print("%2return NULL;\n");
+    print("%1for (i = 0; i < n; i++)\n");
+    print("%2count += %?batch_count(trees[i]);\n");
+    print("%1v = malloc(count * sizeof(*v));\n");
+    print("%1sorted = malloc(count * sizeof(*sorted));\n");
+    print("%1count = 0;\n");
+    print("%1for (i = 0; i < n; i++)\n");
+    print("%2if ((k = %?batch_collect(trees[i], v, &count)) > height)\n");
+    print("%3height = k;\n\n");
+    print("%1/* counting sort by height, then op */\n");
+    print("%1nkeys = (height + 1) * %u;\n", num_terms);
+    print("%1start = calloc(nkeys + 1, sizeof(*start));\n");
+    print("%1for (i = 0; i < count; i++) {\n");
+    print("%2v[i].key = v[i].key * %u + %?batch_op(%s);\n", num_terms, op_expr("v[i].t"));
+    print("%2start[v[i].key + 1]++;\n");
+    print("%1}\n");
+    print("%1for (k = 0; k < nkeys; k++)\n");
+    print("%2start[k + 1] += start[k];\n");
+    print("%1for (i = 0; i < count; i++)\n");
+    print("%2sorted[start[v[i].key]++] = v[i];\n\n");
+    print("%1states = %?ZNEW(count * sizeof(struct %?state));\n");
+    print("%1for (i = 0; i < count; i = k) {\n");
+    print("%2for (k = i; k < count && k - i < %?BATCH_WIDTH && sorted[k].key == sorted[i].key; k++)\n");
+    print("%3b.t[k - i] = sorted[k].t;\n");
+    print("%2%?batch_label(&b, k - i);\n");
+    print("%2%?batch_store(&b, states + i, k - i);\n");
+    print("%1}\n\n");
+    print("%1free(start);\n");
+    print("%1free(sorted);\n");
+    print("%1free(v);\n");
+    print("%1return states;\n");
+    print("}\n\n");
+}
+
+/*
+  Pipelined labeling (-pipeline).
+
+  ?pipeline(next, reduce, arg, depth) labels the trees returned by
+  `next(arg)' on a thread of its own, until `next' returns NULL, and
+  calls `reduce(t, arg)' for each labeled tree on the calling thread,
+  in order. Tree N + 1 is labeled while tree N is reduced; at most
+  `depth' trees are labeled and not yet reduced. A depth below 2 is
+  taken as 2, the slot of tree N being busy until `reduce' returns.
+
+  Each of the `depth' slots owns an arena. While the labeling thread
+  labels the tree of a slot, ?ZNEW allocates the states from its arena,
+  and the arena is recycled for the next tree once the tree is reduced.
+  So the states of a tree are only valid until `reduce' returns, and the
+  state memory is bounded by `depth' trees. Out of ?pipeline, ?ZNEW
+  allocates with malloc.
+
+  struct ?arena {
+      struct ?ablock *blocks;     // filled, then free blocks
+      struct ?ablock *cur;        // block being filled
+      size_t used;
+  };
+ */
+static void emit_arena_type(void)
+{
+    print("struct %?ablock {\n");
+    print("%1struct %?ablock *next;\n");
+    print("%1char data[];\n");
+    print("};\n\n");
+    print("struct %?arena {\n");
+    print("%1struct %?ablock *blocks;         /* filled, then free blocks */\n");
+    print("%1struct %?ablock *cur;            /* block being filled */\n");
+    print("%1size_t used;\n");
+    print("};\n\n");
+}
+
+static void emit_arena_funcs(void)
+{
+    print("/* arena of the tree being labeled, see %?pipeline */\n");
+    print("static %?TLS struct %?arena *%?arena_cur;\n\n");
+
+    print("static void *%?arena_new(size_t size)\n");
+    print("{\n");
+    print("%1struct %?arena *a = %?arena_cur;\n");
+    print("%1void *p;\n\n");
+    print("%1if (a == NULL)\n");
+    print("%2return memset(malloc(size), 0, size);\n");
+    print("%1size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);\n");
+    print("%1assert(size <= %?ARENA_BLOCK);\n");
+    print("%1if (a->cur == NULL || a->used + size > %?ARENA_BLOCK) {\n");
+    print("%2struct %?ablock **link = a->cur ? &a->cur->next : &a->blocks;\n\n");
+    print("%2if (*link == NULL) {\n");
+    print("%3if ((*link = malloc(sizeof(struct %?ablock) + %?ARENA_BLOCK)) == NULL)\n");
+    print("%4abort();\n");
+    print("%3(*link)->next = NULL;\n");
+    print("%2}\n");
+    print("%2a->cur = *link;\n");
+    print("%2a->used = 0;\n");
+    print("%1}\n");
+    print("%1p = a->cur->data + a->used;\n");
+    print("%1a->used += size;\n");
+    print("%1return memset(p, 0, size);\n");
+    print("}\n\n");
+
+    print("static void %?arena_free(struct %?arena *a)\n");
+    print("{\n");
+    print("%1struct %?ablock *b;\n\n");
+    print("%1while ((b = a->blocks)) {\n");
+    print("%2a->blocks = b->next;\n");
+    print("%2free(b);\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
+static void emit_func_pipeline(void)
+{
+    print("struct %?pslot {\n");
+    print("%1%s *tree;                 /* NULL at the end */\n", node_type);
+    print("%1struct %?arena arena;\n");
+    print("};\n\n");
+
+    print("struct %?pipe {\n");
+    print("%1%s *(*next)(void *arg);\n", node_type);
+    print("%1void *arg;\n");
+    print("%1struct %?pslot *slots;\n");
+    print("%1unsigned long depth;\n");
+    print("%1unsigned long head, tail;       /* labeled: [tail, head) */\n");
+    print("%1pthread_mutex_t lock;\n");
+    print("%1pthread_cond_t cond;\n");
+    print("};\n\n");
+
+    print("/* the labeling thread */\n");
+    print("static void *%?plabel_trees(void *arg)\n");
+    print("{\n");
+    print("%1struct %?pipe *pp = arg;\n");
+    print("%1%s *t;\n\n", node_type);
+    print("%1do {\n");
+    print("%2struct %?pslot *s;\n\n");
+    print("%2/* wait for a reduced slot */\n");
+    print("%2pthread_mutex_lock(&pp->lock);\n");
+    print("%2while (pp->head - pp->tail == pp->depth)\n");
+    print("%3pthread_cond_wait(&pp->cond, &pp->lock);\n");
+    print("%2pthread_mutex_unlock(&pp->lock);\n\n");
+    print("%2s = &pp->slots[pp->head %% pp->depth];\n");
+    print("%2if ((t = pp->next(pp->arg))) {\n");
+    print("%3s->arena.cur = NULL;        /* recycle */\n");
+    print("%3%?arena_cur = &s->arena;\n");
+    print("%3%?label(t);\n");
+    print("%3%?arena_cur = NULL;\n");
+    print("%2}\n");
+    print("%2s->tree = t;\n\n");
+    print("%2pthread_mutex_lock(&pp->lock);\n");
+    print("%2pp->head++;\n");
+    print("%2pthread_cond_broadcast(&pp->cond);\n");
+    print("%2pthread_mutex_unlock(&pp->lock);\n");
+    print("%1} while (t);\n");
+    print("%1return NULL;\n");
+    print("}\n\n");
+
+    print("static void %?pipeline(%s *(*next)(void *arg),\n", node_type);
+    print("%3void (*reduce)(%s *t, void *arg), void *arg, int depth)\n", node_type);
+    print("{\n");
+    print("%1struct %?pipe pp;\n");
+    print("%1pthread_t thread;\n\n");
+    print("%1assert(next && reduce && \"%s\");\n", "null callback");
+    print("%1memset(&pp, 0, sizeof(pp));\n");
+    print("%1pp.next = next;\n");
+    print("%1pp.arg = arg;\n");
+    print("%1pp.depth = depth > 2 ? depth : 2;\n");
+    print("%1if ((pp.slots = calloc(pp.depth, sizeof(*pp.slots))) == NULL)\n");
+    print("%2abort();\n");
+    print("%1pthread_mutex_init(&pp.lock, NULL);\n");
+    print("%1pthread_cond_init(&pp.cond, NULL);\n");
+    print("%1if (pthread_create(&thread, NULL, %?plabel_trees, &pp))\n");
+    print("%2abort();\n\n");
+    print("%1for (;;) {\n");
+    print("%2struct %?pslot *s;\n\n");
+    print("%2/* wait for a labeled slot */\n");
+    print("%2pthread_mutex_lock(&pp.lock);\n");
+    print("%2while (pp.head == pp.tail)\n");
+    print("%3pthread_cond_wait(&pp.cond, &pp.lock);\n");
+    print("%2pthread_mutex_unlock(&pp.lock);\n\n");
+    print("%2s = &pp.slots[pp.tail %% pp.depth];\n");
+    print("%2if (s->tree == NULL)\n");
+    print("%3break;\n");
+    print("%2reduce(s->tree, arg);\n\n");
+    print("%2pthread_mutex_lock(&pp.lock);\n");
+    print("%2pp.tail++;\n");
+    print("%2pthread_cond_broadcast(&pp.cond);\n");
+    print("%2pthread_mutex_unlock(&pp.lock);\n");
+    print("%1}\n\n");
+    print("%1pthread_join(thread, NULL);\n");
+    print("%1for (unsigned long i = 0; i < pp.depth; i++)\n");
+    print("%2%?arena_free(&pp.slots[i].arena);\n");
+    print("%1pthread_cond_destroy(&pp.cond);\n");
+    print("%1pthread_mutex_destroy(&pp.lock);\n");
+    print("%1free(pp.slots);\n");
+    print("}\n\n");
+}
+
+/*
+  Labeling context (-context).
+
+  The states are kept out of the nodes, in a ?ctx owned by the caller:
+  an open addressed table keyed by node pointers, or the caller's array
+  indexed by NODE_ID(p) if defined. ?label, ?rule and the closures take
+  the context, so several labelings of the same nodes can coexist.
+
+  struct ?ctx {
+  #ifdef NODE_ID
+      struct ?state **states;
+  #else
+      const NODE_TYPE **keys;
+      struct ?state **vals;
+      unsigned int size, count;
+  #endif
+  };
+ */
+static void emit_ctx_type(void)
+{
+    print("struct %?ctx {\n");
+    print("#ifdef %s\n", NODE_ID);
+    print("%1struct %?state **states;\n");
+    print("#else\n");
+    print("%1const %s **keys;\n", node_type);
+    print("%1struct %?state **vals;\n");
+    print("%1unsigned int size, count;\n");
+    print("#endif\n");
+    print("};\n\n");
+}
+
+static void emit_ctx_funcs(void)
+{
+    /* init */
+    print("static void %?ctx_init(struct %?ctx *ctx, struct %?state **states)\n");
+    print("{\n");
+    print("%1memset(ctx, 0, sizeof(*ctx));\n");
+    print("#ifdef %s\n", NODE_ID);
+    print("%1ctx->states = states;\n");
+    print("#else\n");
+    print("%1(void)states;\n");
+    print("#endif\n");
+    print("}\n\n");
+    /* free */
+    print("static void %?ctx_free(struct %?ctx *ctx)\n");
+    print("{\n");
+    print("#ifndef %s\n", NODE_ID);
+    print("%1free(ctx->keys);\n");
+    print("%1free(ctx->vals);\n");
+    print("#endif\n");
+    print("%1memset(ctx, 0, sizeof(*ctx));\n");
+    print("}\n\n");
+    /* grow */
+    print("#ifndef %s\n", NODE_ID);
+    print("#define %?CTX_HASH(p) ((unsigned int)((size_t)(p) >> 4) * 2654435761u)\n\n");
+    print("static void %?ctx_grow(struct %?ctx *ctx)\n");
+    print("{\n");
+    print("%1unsigned int size = ctx->size ? ctx->size * 2 : 1024;\n");
+    print("%1const %s **keys = calloc(size, sizeof(*keys));\n", node_type);
+    print("%1struct %?state **vals = calloc(size, sizeof(*vals));\n\n");
+    print("%1for (unsigned int i = 0; i < ctx->size; i++) {\n");
+    print("%2unsigned int j;\n\n");
+    print("%2if (!ctx->keys[i])\n");
+    print("%3continue;\n");
+    print("%2for (j = %?CTX_HASH(ctx->keys[i]) & (size - 1); keys[j]; j = (j + 1) & (size - 1))\n");
+    print("%3;\n");
+    print("%2keys[j] = ctx->keys[i];\n");
+    print("%2vals[j] = ctx->vals[i];\n");
+    print("%1}\n");
+    print("%1free(ctx->keys);\n");
+    print("%1free(ctx->vals);\n");
+    print("%1ctx->keys = keys;\n");
+    print("%1ctx->vals = vals;\n");
+    print("%1ctx->size = size;\n");
+    print("}\n");
+    print("#endif\n\n");
+    /* get */
+    print("static struct %?state *%?ctx_get(struct %?ctx *ctx, const %s *p)\n", node_type);
+    print("{\n");
+    print("#ifdef %s\n", NODE_ID);
+    print("%1return ctx->states[%s(p)];\n", NODE_ID);
+    print("#else\n");
+    print("%1unsigned int i;\n\n");
+    print("%1if (!ctx->size)\n");
+    print("%2return NULL;\n");
+    print("%1for (i = %?CTX_HASH(p) & (ctx->size - 1); ctx->keys[i]; i = (i + 1) & (ctx->size - 1))\n");
+    print("%2if (ctx->keys[i] == p)\n");
+    print("%3return ctx->vals[i];\n");
+    print("%1return NULL;\n");
+    print("#endif\n");
+    print("}\n\n");
+    /* put */
+    print("static void %?ctx_put(struct %?ctx *ctx, const %s *p, struct %?state *state)\n", node_type);
+    print("{\n");
+    print("#ifdef %s\n", NODE_ID);
+    print("%1ctx->states[%s(p)] = state;\n", NODE_ID);
+    print("#else\n");
+    print("%1unsigned int i;\n\n");
+    print("%1if (2 * (ctx->count + 1) > ctx->size)\n");
+    print("%2%?ctx_grow(ctx);\n");
+    print("%1for (i = %?CTX_HASH(p) & (ctx->size - 1); ctx->keys[i]; i = (i + 1) & (ctx->size - 1))\n");
+    print("%2if (ctx->keys[i] == p)\n");
+    print("%3break;\n");
+    print("%1if (!ctx->keys[i]) {\n");
+    print("%2ctx->keys[i] = p;\n");
+    print("%2ctx->count++;\n");
+    print("%1}\n");
+    print("%1ctx->vals[i] = state;\n");
+    print("#endif\n");
+    print("}\n\n");
+}
+
+/*
+  Function: ?label_N(NODE_TYPE *t, struct ?state *p)
+
+  The cases of ?label for the terms in partition `part' (-split).
+  The state of `t' has been allocated and initialized by ?label.
+ */
+static void emit_func_label_part(int part)
+{
+    int c = 0;
+
+    for (struct term *t = terms; t; t = t->link)
+        for (struct rule *r = t->rules; r && t->part == part; r = r->tlink)
+            c |= t->nkids > 0 || r->cost == -1;
+
+    print("void %?label_%d(%s *t, struct %?state *p)\n", part, node_type);
+    print("{\n");
+    if (c)
+        print("%1int c;\n\n");
+    print("%1switch (%s) {\n", op_expr("t"));
+    for (struct term *t = terms; t; t = t->link)
+        if (t->part == part)
+            emit_case(t);
+    print("%1default:\n");
+    print("%2abort();\n");
+    print("%1}\n");
+    print("}\n\n");
+}
+
+/*
+  Hash-consed states (-share).
+
+  Many nodes have the same labeling: every ADDRLP, every CNSTI(...) and so
+  on. With -share the states are interned by content and ?label looks up a
+  transition table keyed by the op, the kid states and the results of the
+  dynamic costs before doing any work. On a hit the node just points to the
+  shared state; on a miss the rules are matched into a scratch state which
+  is then interned and the transition recorded.
+
+  A state is identified by its costs, rules and, with -need, needs plus
+  its op, because patterns test the op of kids. If a pattern reaches below a kid
+  (`share_deep'), the costs of the grandkids matter as well, so the kid
+  states are part of the state too.
+
+  Costs are normalized to the minimum cost of the node (`key.norm'),
+  since a parent whose rules all take the costs of nonterms at the same
+  positions shifts each rule by the same amount and selects the same.
+  When the rules of a term take them at different positions, one reading
+  a kid and another the kid's kid through a term of its pattern, the
+  terms inside its patterns keep raw costs (`t->raw'), so both readings
+  stay apart by the real costs. Raw costs share less but are exact.
+
+  Dynamic costs are evaluated for the key before the lookup (those of
+  chain rules unconditionally), and on a miss the rules take them from
+  the key: `key.dyn[i]' in ?label, `?share_key->dyn[i]' in the closures,
+  kept by ern in `share_code'.
+  Shared states are not allocated with ?ZNEW; they live until
+  ?share_clear().
+ */
+static int share_deep;            /* states include the kid states */
+static int share_norm;            /* some terms are normalized */
+static int share_dyn;             /* number of dynamic cost slots */
+static int share_chain;           /* first slot of chain rules */
+
+static int cmp_path(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* sorted paths of the nonterm leaves of `r', see compute_paths */
+static int leaf_paths(struct rule *r, unsigned int *paths)
+{
+    int nts[max_nts + 1];
+    int n = 0;
+
+    compute_paths(r->pattern, 0, 0, nts, paths, &n);
+    qsort(paths, n, sizeof(unsigned int), cmp_path);
+    return n;
+}
+
+/* the terms below the root of `p' keep raw costs */
+static void mark_raw(struct pattern *p)
+{
+    for (int i = 0; i < p->nkids; i++) {
+        struct term *k = p->kids[i]->op;
+        if (k->kind == TERM) {
+            k->raw = 1;
+            mark_raw(p->kids[i]);
+        }
+    }
+}
+
+static void build_share(void)
+{
+    if (!flat_bits)
+        flat_bits = max_kids > 1 ? bits(max_kids - 1) : 1;
+    share_code = NEWARRAY(sizeof(char *), num_rules + 1);
+    for (struct term *t = terms; t; t = t->link) {
+        unsigned int first[max_nts + 1], paths[max_nts + 1];
+        int n = 0, dyn = 0, uniform = 1;
+
+        for (struct rule *r = t->rules; r; r = r->tlink) {
+            struct pattern *p = r->pattern;
+            int m = leaf_paths(r, paths);
+
+            if (r == t->rules) {
+                memcpy(first, paths, m * sizeof(unsigned int));
+                n = m;
+            } else if (m != n || memcmp(first, paths, m * sizeof(unsigned int))) {
+                uniform = 0;
+            }
+            for (int i = 0; i < p->nkids; i++) {
+                struct term *k = p->kids[i]->op;
+                if (k->kind == TERM && p->kids[i]->nkids > 0)
+                    share_deep = 1;
+            }
+            if (r->cost == -1)
+                share_code[r->ern] = format("key.dyn[%d]", dyn++);
+        }
+        if (!uniform)
+            for (struct rule *r = t->rules; r; r = r->tlink)
+                mark_raw(r->pattern);
+        if (dyn > share_chain)
+            share_chain = dyn;
+    }
+    for (struct term *t = terms; t; t = t->link)
+        share_norm |= !t->raw;
+    share_dyn = share_chain;
+    for (struct rule *r = rules; r; r = r->link)
+        if (r->pattern->nterms == 0 && r->cost == -1)
+            share_code[r->ern] = format("%sshare_key->dyn[%d]", prefix, share_dyn++);
+}
+
+/*
+  struct ?trans {
+      struct ?trans *link;
+      unsigned int hash;
+      int op;
+      int norm;                   // costs are normalized, by op
+      struct ?state *kids[max_kids];
+      int dyn[share_dyn];
+      struct ?state *state;
+  };
+ */
+static void emit_share_types(void)
+{
+    print("struct %?trans {\n");
+    print("%1struct %?trans *link;\n");
+    print("%1unsigned int hash;\n");
+    print("%1int op;\n");
+    if (share_norm)
+        print("%1int norm;\n");
+    if (max_kids > 0)
+        print("%1struct %?state *kids[%d];\n", max_kids);
+    if (share_dyn > 0)
+        print("%1int dyn[%d];\n", share_dyn);
+    print("%1struct %?state *state;\n");
+    print("};\n\n");
+    if (share_dyn > share_chain)
+        print("static struct %?trans *%?share_key; /* key of the node being labeled */\n\n");
+}
+
+/* a field of a state or transition: hash it or compare it */
+static void emit_share_field(const char *field, int ptr, int eq)
+{
+    if (eq)
+        print("%1if (a->%s != b->%s)\n%2return 0;\n", field, field);
+    else if (ptr)
+        print("%1h = %?HASH_STEP(h, (size_t)a->%s >> 4);\n", field);
+    else
+        print("%1h = %?HASH_STEP(h, a->%s);\n", field);
+}
+
+/* the fields identifying a state or, if `trans', a transition */
+static void emit_share_fields(int trans, int eq)
+{
+    emit_share_field("op", 0, eq);
+    if (trans || share_deep)
+        for (int i = 0; i < max_kids; i++)
+            emit_share_field(format("kids[%d]", i), 1, eq);
+    if (trans) {
+        for (int i = 0; i < share_dyn; i++)
+            emit_share_field(format("dyn[%d]", i), 0, eq);
+        return;
+    }
+    for (int i = 1; i <= num_nonterms; i++)
+        emit_share_field(format("costs[%d]", i), 0, eq);
+    for (int i = 1; need && i <= num_nonterms; i++)
+        emit_share_field(format("need[%d]", i), 0, eq);
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        emit_share_field(format("rule.%s", nt->name), 0, eq);
+}
+
+/* ?grow_xx(): double the table of `xx' */
+static void emit_share_grow(const char *name, const char *type)
+{
+    print("static void %?grow_%s(void)\n", name);
+    print("{\n");
+    print("%1unsigned int size = %?%s_size ? %?%s_size * 2 : 256;\n", name, name);
+    print("%1%s **tab = calloc(size, sizeof(%s *));\n\n", type, type);
+    print("%1for (unsigned int i = 0; i < %?%s_size; i++) {\n", name);
+    print("%2%s *e, *next;\n", type);
+    print("%2for (e = %?%s_tab[i]; e; e = next) {\n", name);
+    print("%3next = e->link;\n");
+    print("%3e->link = tab[e->hash & (size - 1)];\n");
+    print("%3tab[e->hash & (size - 1)] = e;\n");
+    print("%2}\n");
+    print("%1}\n");
+    print("%1free(%?%s_tab);\n", name);
+    print("%1%?%s_tab = tab;\n", name);
+    print("%1%?%s_size = size;\n", name);
+    print("}\n\n");
+}
+
+static void emit_share_funcs(void)
+{
+    static const char *names[] = { "state", "trans" };
+
+    print("#define %?HASH_STEP(h, x) (((h) ^ (unsigned int)(x)) * 16777619u)\n\n");
+    for (int i = 0; i < 2; i++) {
+        const char *name = names[i];
+        const char *type = format("struct %s%s", prefix, name);
+
+        print("static %s **%?%s_tab;\n", type, name);
+        print("static unsigned int %?%s_size, %?%s_count;\n\n", name, name);
+        /* hash */
+        print("static unsigned int %?%s_hash(const %s *a)\n", name, type);
+        print("{\n");
+        print("%1unsigned int h = 2166136261u;\n\n");
+        emit_share_fields(i, 0);
+        print("%1return h;\n");
+        print("}\n\n");
+        /* equal */
+        print("static int %?%s_equal(const %s *a, const %s *b)\n", name, type, type);
+        print("{\n");
+        emit_share_fields(i, 1);
+        print("%1return 1;\n");
+        print("}\n\n");
+        emit_share_grow(name, type);
+    }
+
+    /* lookup */
+    print("static struct %?state *%?lookup(struct %?trans *key)\n");
+    print("{\n");
+    print("%1struct %?trans *e;\n\n");
+    print("%1if (%?trans_count >= %?trans_size)\n");
+    print("%2%?grow_trans();\n");
+    print("%1key->hash = %?trans_hash(key);\n");
+    print("%1for (e = %?trans_tab[key->hash & (%?trans_size - 1)]; e; e = e->link)\n");
+    print("%2if (e->hash == key->hash && %?trans_equal(e, key))\n");
+    print("%3return e->state;\n");
+    print("%1return NULL;\n");
+    print("}\n\n");
+
+    /* intern */
+    print("static struct %?state *%?share(struct %?trans *key, struct %?state *s)\n");
+    print("{\n");
+    print("%1struct %?state *p;\n");
+    print("%1struct %?trans *e;\n");
+    print("%1unsigned int h;\n");
+    if (share_norm) {
+        print("\n%1if (key->norm) {\n");
+        print("%2int min = 0x%x;\n\n", MAX_COST);
+        print("%2for (int i = 1; i <= %d; i++)\n", num_nonterms);
+        print("%3if (s->costs[i] < min)\n");
+        print("%4min = s->costs[i];\n");
+        print("%2for (int i = 1; i <= %d; i++)\n", num_nonterms);
+        print("%3if (s->costs[i] != 0x%x)\n", MAX_COST);
+        print("%4s->costs[i] -= min;\n");
+        print("%1}\n");
+    } else {
+        print("\n%1/* not normalized: rules of a term take costs at different positions */\n");
+    }
+    print("%1s->op = key->op;\n");
+    if (share_deep && max_kids > 0)
+        print("%1memcpy(s->kids, key->kids, sizeof(s->kids));\n");
+    print("%1if (%?state_count >= %?state_size)\n");
+    print("%2%?grow_state();\n");
+    print("%1s->hash = h = %?state_hash(s);\n");
+    print("%1for (p = %?state_tab[h & (%?state_size - 1)]; p; p = p->link)\n");
+    print("%2if (p->hash == h && %?state_equal(p, s))\n");
+    print("%3break;\n");
+    print("%1if (!p) {\n");
+    print("%2p = malloc(sizeof(struct %?state));\n");
+    print("%2*p = *s;\n");
+    print("%2p->link = %?state_tab[h & (%?state_size - 1)];\n");
+    print("%2%?state_tab[h & (%?state_size - 1)] = p;\n");
+    print("%2%?state_count++;\n");
+    print("%1}\n");
+    print("%1e = malloc(sizeof(struct %?trans));\n");
+    print("%1*e = *key;\n");
+    print("%1e->state = p;\n");
+    print("%1e->link = %?trans_tab[key->hash & (%?trans_size - 1)];\n");
+    print("%1%?trans_tab[key->hash & (%?trans_size - 1)] = e;\n");
+    print("%1%?trans_count++;\n");
+    print("%1return p;\n");
+    print("}\n\n");
+
+    /* clear */
+    print("static void %?share_clear(void)\n");
+    print("{\n");
+    for (int i = 0; i < 2; i++) {
+        const char *name = names[i];
+
+        print("%1for (unsigned int i = 0; i < %?%s_size; i++) {\n", name);
+        print("%2struct %?%s *e, *next;\n", name);
+        print("%2for (e = %?%s_tab[i]; e; e = next) {\n", name);
+        print("%3next = e->link;\n");
+        print("%3free(e);\n");
+        print("%2}\n");
+        print("%1}\n");
+        print("%1free(%?%s_tab);\n", name);
+        print("%1%?%s_tab = NULL;\n", name);
+        print("%1%?%s_size = %?%s_count = 0;\n", name, name);
+    }
+    print("}\n\n");
+}
+
+/*
+  ?label with -share, see also: emit_func_label
+
+  static void ?label(NODE_TYPE *t)
+  {
+      int c;
+      struct ?state *p, s;
+      struct ?trans key;
+
+      assert(t && "null tree");
+
+      memset(&key, 0, sizeof(key));
+      key.op = NODE_OP(t);
+      switch (key.op) {
+      ... label kids, key.norm, key.kids[i] = kid states,
+          key.dyn[i] = dynamic costs ...
+      default:
+          abort();
+      }
+      key.dyn[i] = dynamic costs of chain rules;
+      if ((p = ?lookup(&key)) != NULL) {
+          NODE_STATE(t) = p;
+          return;
+      }
+
+      memset(&s, 0, sizeof(s));
+      NODE_STATE(t) = p = &s;
+      ?share_key = &key;
+      ... initialize costs to MAX_COST ...
+      switch (key.op) {
+      ... emit cases, dynamic costs from key.dyn[i] ...
+      }
+      NODE_STATE(t) = ?share(&key, &s);
+  }
+ */
+static void emit_func_label_share(void)
+{
+    int chain = share_chain;
+
+    emit_head("void");
+    print("%?label(%s *t)\n", node_type);
+    print("{\n");
+    print("%1int c;\n");
+    print("%1struct %?state *p, s;\n");
+    print("%1struct %?trans key;\n\n");
+    print("%1assert(t && \"%s\");\n\n", "null tree");
+    print("%1memset(&key, 0, sizeof(key));\n");
+    print("%1key.op = %s;\n", op_expr("t"));
+    print("%1switch (key.op) {\n");
+    for (struct term *t = terms; t; t = t->link) {
+        int dyn = 0;
+
+        print("%1case %d: /* %K */\n", t->id, t);
+        emit_case_kids(t);
+        if (share_norm && !t->raw)
+            print("%2key.norm = 1;\n");
+        for (int i = 0; i < t->nkids; i++)
+            print("%2key.kids[%d] = %s;\n", i, state_expr(kid_expr("t", i)));
+        for (struct rule *r = t->rules; r; r = r->tlink) {
+            if (r->cost != -1)
+                continue;
+            print("%2/* %d. %R */\n", r->ern, r);
+            if (r->pattern->nterms > 1) {
+                int n = r->pattern->nterms - 1;
+                print("%2if (\n");
+                emit_cond("\t\t\t", r->pattern, "t", &n);
+                print("%2)\n");
+                print("%3key.dyn[%d] = %s;\n", dyn++, r->code);
+            } else {
+                print("%2key.dyn[%d] = %s;\n", dyn++, r->code);
+            }
+        }
+        print("%2break;\n");
+    }
+    print("%1default:\n");
+    print("%2abort();\n");
+    print("%1}\n");
+    for (struct rule *r = rules; r; r = r->link)
+        if (r->pattern->nterms == 0 && r->cost == -1) {
+            print("%1/* %d. %R */\n", r->ern, r);
+            print("%1key.dyn[%d] = %s;\n", chain++, r->code);
+        }
+    print("%1if ((p = %?lookup(&key)) != NULL) {\n");
+    print("%2%s(t) = p;\n", NODE_STATE);
+    print("%2return;\n");
+    print("%1}\n\n");
+
+    print("%1memset(&s, 0, sizeof(s));\n");
+    print("%1%s(t) = p = &s;\n", NODE_STATE);
+    if (share_dyn > share_chain)
+        print("%1%?share_key = &key;\n");
+    emit_init_costs();
+    print("%1switch (key.op) {\n");
+    for (struct term *t = terms; t; t = t->link) {
+        print("%1case %d: /* %K */\n", t->id, t);
+        emit_case_rules(t);
+        print("%2break;\n");
+    }
+    print("%1}\n");
+    print("%1%s(t) = %?share(&key, &s);\n", NODE_STATE);
+    print("}\n\n");
+}
+
+/*
+  ?node_traits and ?labeler, see also: emit_forwards
+
+  template <class Traits>
+  struct ?labeler {
+      typedef typename Traits::node_type node_type;
+      static void ?closure_xx(node_type *t, int c);
+      ...
+      static void ?label(node_type *t);
+      static void ?kids(node_type *p, int ruleno, node_type *kids[]);
+  };
+ */
+static void emit_cxx_labeler(void)
+{
+    print("struct %?node_traits {\n");
+    print("%1static %?state *new_state() { return new %?state(); }\n");
+    print("};\n\n");
+    print("template <class Traits>\n");
+    print("struct %?labeler {\n");
+    print("%1typedef typename Traits::node_type node_type;\n");
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        if (nt->chain)          /* has closure */
+            print("%1static void %?closure_%K(node_type *t, int c);\n", nt);
+    print("%1static void %?label(node_type *t);\n");
+    print("%1static void %?kids(node_type *p, int ruleno, node_type *kids[]);\n");
+    print("};\n\n");
+}
+
+/* ?label<Traits>(t) and ?kids<Traits>(p, ruleno, kids) */
+static void emit_cxx_wrappers(void)
+{
+    print("template <class Traits>\n");
+    print("inline void %?label(typename Traits::node_type *t)\n");
+    print("{\n");
+    print("%1%?labeler<Traits>::%?label(t);\n");
+    print("}\n\n");
+    print("template <class Traits>\n");
+    print("inline void %?kids(typename Traits::node_type *p, int ruleno,\n");
+    print("%1%1  typename Traits::node_type *kids[])\n");
+    print("{\n");
+    print("%1%?labeler<Traits>::%?kids(p, ruleno, kids);\n");
+    print("}\n\n");
 }
 
 static void emit_functions(void)
 {
+    if (context)
+        emit_ctx_funcs();
+    if (pipeline)
+        emit_arena_funcs();
+    if (need)
+        emit_func_need();
+    if (array)
+        emit_array_costs();
     emit_func_rule();
     for (struct nonterm *nt = nonterms; nt; nt = nt->link)
-        if (nt->chain)          /* has closure */
+        if (has_closure(nt))
             emit_func_closure(nt);
-    emit_func_label();
+    if (share) {
+        emit_share_funcs();
+        emit_func_label_share();
+    } else if (array) {
+        emit_func_label_array();
+    } else {
+        emit_func_label();
+    }
     emit_func_kids();
+    if (need)
+        emit_func_kids_ordered();
+    if (parallel)
+        emit_func_parallel();
+    if (batch)
+        emit_func_batch();
+    if (pipeline)
+        emit_func_pipeline();
+    if (cxx)
+        emit_cxx_wrappers();
 }
 
 /* static void ?closure_xx(NODE_TYPE *t, int c) */
 static void emit_forwards(void)
 {
-    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
-        if (nt->chain)          /* has closure */
-            print("static void %?closure_%K(%s *t, int c);\n", nt, NODE_TYPE);
+    if (cxx) {
+        emit_cxx_labeler();
+        return;
+    }
+    for (int m = 0; m < (num_models > 1 ? num_models : 1); m++) {
+        select_model(m);
+        for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+            if (has_closure(nt))
+                print("%svoid %?closure_%K%s(%s%s, int c);\n", split ? "" : "static ",
+                      nt, msuffix(), extra_params(), node_param("t"));
+    }
+    select_model(0);
     print("\n");
 }
 
@@ -768,10 +2972,8 @@ static char *compute_nts(struct pattern *p, char *bp, int *j)
     struct term *t = p->op;
     
     if (t->kind == TERM) {
-        if (p->left)
-            bp = compute_nts(p->left, bp, j);
-        if (p->right)
-            bp = compute_nts(p->right, bp, j);
+        for (int i = 0; i < p->nkids; i++)
+            bp = compute_nts(p->kids[i], bp, j);
     } else {
         sprintf(bp, "%s%s_NT, ", prefix, t->name);
         bp += strlen(bp);
@@ -805,24 +3007,36 @@ static void emit_var_nts(void)
         if (str[j] == NULL) {
             /* if _NOT_ found */
             /* static short ?nts_j[] = { buf, 0 }; */
-            print("static short %?nts_%d[] = { %s0 };\n", j, buf);
+            print("%Sshort %?nts_%d[] = { %s0 };\n", j, buf);
             str[j] = xstrdup(buf);
         }
         nts[i] = j;
     }
     /* static short * ?nts[] */
-    print("\nstatic short *%?nts[] = {\n");
+    print("\n%S%sshort *%?nts[] = {\n", cxx ? "const " : "");
     print("%10,\n");
     for (i = 0, r = rules; r; r = r->link, i++)
         print("%1%?nts_%d, // %d. %R\n", nts[i], r->ern, r);
-    print("};\n");
-    print("#define %?MAX_NTS %d\n\n", max);
+    print("};\n\n");
+}
+
+/* ?NTS(ruleno) is the nonterm sequence of `ruleno' in both encodings */
+static void emit_macro_nts(void)
+{
+    if (flat)
+        print("#define %?NTS(ruleno) (&%?nts_flat[%?nts_offset[ruleno]])\n");
+    else
+        print("#define %?NTS(ruleno) (%?nts[ruleno])\n");
+    if (cxx)
+        print("%Sint %?MAX_NTS = %d;\n\n", max_nts);
+    else
+        print("#define %?MAX_NTS %d\n\n", max_nts);
 }
 
 /* indexed by ?xxx_NT */
 static void emit_var_nt_names(void)
 {
-    print("static const char *%?nt_names[] = {\n");
+    print("%Sconst char *%?nt_names[] = {\n");
     print("%10,\n");
     for (struct nonterm *nt = nonterms; nt; nt = nt->link)
         print("%1\"%K\",\n", nt);
@@ -832,7 +3046,7 @@ static void emit_var_nt_names(void)
 
 static void emit_var_rule_names(void)
 {
-    print("static const char *%?rule_names[] = {\n%10,\n");
+    print("%Sconst char *%?rule_names[] = {\n%10,\n");
     for (struct rule *r = rules; r; r = r->link)
         print("%1\"%R\", // %d\n", r, r->ern);
     print("};\n\n");
@@ -842,7 +3056,7 @@ static void emit_var_rule_names(void)
 static void emit_var_nt_rules(void)
 {
     for (struct nonterm *nt = nonterms; nt; nt = nt->link) {
-        print("static short %?%K_rules[] = {\n", nt);
+        print("%Sshort %?%K_rules[] = {\n", nt);
         print("%10,\n");
         for (struct rule *rule = nt->rules; rule; rule = rule->nlink)
             print("%1%d, // %R\n", rule->ern, rule);
@@ -852,7 +3066,7 @@ static void emit_var_nt_rules(void)
 
 static void emit_var_templates(void)
 {
-    print("static const char *%?templates[] = {\n");
+    print("%Sconst char *%?templates[] = {\n");
     print("%1\"\",\n");
     for (struct rule *rule = rules; rule; rule = rule->link) {
         if (rule->template)
@@ -865,16 +3079,12 @@ static void emit_var_templates(void)
 
 static void emit_var_is_instruction(void)
 {
-    print("static char %?is_instruction[] = {\n");
+    print("%Schar %?is_instruction[] = {\n");
     print("%10,\n");
     for (struct rule *rule = rules; rule; rule = rule->link) {
         if (rule->template) {
-            int len = strlen(rule->template);
             print("%1%d, // %d. \"%s\"\n",
-                  len >= 2 &&
-                  rule->template[len - 2] == '\\' &&
-                  rule->template[len - 1] == 'n',
-                  rule->ern, rule->template);
+                  is_instruction(rule), rule->ern, rule->template);
         } else {
             print("%10,\n");
         }
@@ -882,58 +3092,775 @@ static void emit_var_is_instruction(void)
     print("};\n\n");
 }
 
+/*
+  Trace ring buffer (-ring).
+
+  Instead of calling ?trace, every candidate comparison stores a fixed
+  size event into a per-thread ring buffer of the last ?TRACE_SIZE events
+  when ?trace_on is set, so tracing can stay compiled in and be switched
+  on at run time. ?trace_dump(fp) prints the events, oldest first. -T
+  can't be given too: the ring replaces the calls.
+
+  struct ?trace_event {
+      const void *node;
+      int op;
+      short rule;
+      short nt;
+      int cost;
+      int bestcost;
+      int depth;          // closure depth
+  };
+ */
+static void emit_trace_ring(void)
+{
+    print("#ifndef %?TRACE_SIZE\n");
+    print("#define %?TRACE_SIZE %u\n", ring);
+    print("#endif\n");
+    print("#ifndef %?TLS\n");
+    print("#define %?TLS __thread\n");
+    print("#endif\n\n");
+    print("struct %?trace_event {\n");
+    print("%1const void *node;\n");
+    print("%1int op;\n");
+    print("%1short rule;\n");
+    print("%1short nt;\n");
+    print("%1int cost;\n");
+    print("%1int bestcost;\n");
+    print("%1int depth;\n");
+    print("};\n\n");
+    print("static int %?trace_on;\n");
+    print("static %?TLS struct %?trace_event %?trace_ring[%?TRACE_SIZE];\n");
+    print("static %?TLS unsigned int %?trace_head;   /* next slot */\n");
+    print("static %?TLS unsigned int %?trace_count;  /* events in the ring */\n");
+    print("static %?TLS int %?trace_depth;\n\n");
+
+    print("static void %?trace_record(const void *t, int op, int ruleno, int nt,\n");
+    print("%1%1%1%1  int cost, int bestcost)\n");
+    print("{\n");
+    print("%1struct %?trace_event *e = &%?trace_ring[%?trace_head];\n\n");
+    print("%1if (++%?trace_head == %?TRACE_SIZE)\n");
+    print("%2%?trace_head = 0;\n");
+    print("%1if (%?trace_count < %?TRACE_SIZE)\n");
+    print("%2%?trace_count++;\n");
+    print("%1e->node = t;\n");
+    print("%1e->op = op;\n");
+    print("%1e->rule = ruleno;\n");
+    print("%1e->nt = nt;\n");
+    print("%1e->cost = cost;\n");
+    print("%1e->bestcost = bestcost;\n");
+    print("%1e->depth = %?trace_depth;\n");
+    print("}\n\n");
+
+    print("static void %?trace_dump(FILE *fp)\n");
+    print("{\n");
+    print("%1unsigned int first = %?trace_head + %?TRACE_SIZE - %?trace_count;\n\n");
+    print("%1for (unsigned int i = 0; i < %?trace_count; i++) {\n");
+    print("%2const struct %?trace_event *e = &%?trace_ring[(first + i) %% %?TRACE_SIZE];\n");
+    print("%2fprintf(fp, \"%%*s%%p, %%d, %%d. %%s with %%d vs. %%d (%%s)\\n\",\n");
+    print("%2%2e->depth * 2, \"\", e->node, e->op, e->rule, %?rule_names[e->rule],\n");
+    print("%2%2e->cost, e->bestcost, %?nt_names[e->nt]);\n");
+    print("%1}\n");
+    print("}\n\n");
+
+    print("static void %?trace_reset(void)\n");
+    print("{\n");
+    print("%1%?trace_head = 0;\n");
+    print("%1%?trace_count = 0;\n");
+    print("}\n\n");
+}
+
 static void emit_variables(void)
 {
-    emit_var_nts();
+    if (flat)
+        emit_var_nts_flat();
+    else
+        emit_var_nts();
+    if (!split)
+        emit_macro_nts();
     emit_var_nt_names();
     emit_var_rule_names();
     emit_var_templates();
     emit_var_is_instruction();
     emit_var_nt_rules();
+    if (ring)
+        emit_trace_ring();
+    emit_var_leaves();
 }
 
 /*
   struct ?state {
       short costs[nts_cnt+1];
+      unsigned int derive[nts_cnt/32+1];
+      short need[nts_cnt+1];              // -need
       struct {
           unsigned int nt: nt->nrules;
           ...
       } rule;
+      // with several cost models: costs[M][], derive[M][], need[M][], rule[M]
+      // -share: int op; struct ?state *kids[], *link; unsigned int hash;
   };
  */
 static void emit_types(void)
 {
     print("struct %?state {\n");
-    print("%1short costs[%d];\n", num_nonterms + 1);
+    char *m = num_models > 1 ? format("[%d]", num_models) : "";
+
+    print("%1short costs%s[%d];\n", m, num_nonterms + 1);
+    print("%1// derivable nonterms, bit n for nonterm n\n");
+    print("%1unsigned int derive%s[%d];\n", m, num_nonterms / 32 + 1);
+    if (need)
+        print("%1short need%s[%d];\n", m, num_nonterms + 1);
     print("%1// indexed by inner rule number\n");
     print("%1struct {\n");
     for (struct nonterm *nt = nonterms; nt; nt = nt->link)
         print("%2unsigned int %K: %d;\n", nt, bits(nt->nrules));
-    print("%1} rule;\n");
+    print("%1} rule%s;\n", m);
+    if (share) {
+        print("%1int op;\n");
+        if (share_deep && max_kids > 0)
+            print("%1struct %?state *kids[%d];\n", max_kids);
+        print("%1struct %?state *link;\n");
+        print("%1unsigned int hash;\n");
+    }
     print("};\n\n");
+    if (share)
+        emit_share_types();
+    if (context)
+        emit_ctx_type();
+    if (pipeline)
+        emit_arena_type();
 }
 
 static void emit_macros(void)
 {
-    /* ?ZNEW */
-    print("#ifndef %?ZNEW\n");
-    print("#define %?ZNEW(size) memset(malloc(size), 0, (size))\n");
-    print("#endif\n\n");
+    if (cxx) {
+        for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+            print("%Sint %?%K_NT = %d;\n", nt, nt->number);
+        print("%Sint %?NUM_NTS = %d;\n", num_nonterms);
+        print("\n");
+        return;
+    }
+    /* ?ZNEW and KID, states and kids are in arrays with -array */
+    if (!array) {
+        print("#ifndef %?ZNEW\n");
+        if (pipeline)
+            print("#define %?ZNEW(size) %?arena_new(size)\n");
+        else
+            print("#define %?ZNEW(size) memset(malloc(size), 0, (size))\n");
+        print("#endif\n\n");
+        print("#ifndef %s\n", KID);
+        if (max_kids > 2)
+            print("#error \"%s(p, i) must be defined for terminals with more than two kids\"\n", KID);
+        else
+            print("#define %s(p, i) ((i) ? %s(p) : %s(p))\n", KID, RIGHT_KID, LEFT_KID);
+        print("#endif\n\n");
+    }
     /* xx_NT */
     for (struct nonterm *nt = nonterms; nt; nt = nt->link)
         print("#define %?%K_NT %d\n", nt, nt->number);
     print("#define %?NUM_NTS %d\n", num_nonterms);
     print("\n");
+    /* cost models */
+    if (num_models > 1) {
+        for (int i = 0; i < num_models; i++)
+            print("#define %?%s_MODEL %d\n", model_names[i], i);
+        print("#define %?NUM_MODELS %d\n\n", num_models);
+    }
+    /* -parallel */
+    if (parallel) {
+        print("#ifndef %?PAR_THRESHOLD\n");
+        print("#define %?PAR_THRESHOLD 4096\n");
+        print("#endif\n");
+        print("#ifndef %?ATOMIC_DEC\n");
+        print("#define %?ATOMIC_DEC(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)\n");
+        print("#endif\n\n");
+    }
+    /* -pipeline */
+    if (pipeline) {
+        print("#ifndef %?ARENA_BLOCK\n");
+        print("#define %?ARENA_BLOCK 65536\n");
+        print("#endif\n");
+        print("#ifndef %?TLS\n");
+        print("#define %?TLS __thread\n");
+        print("#endif\n\n");
+    }
+    /* -batch */
+    if (batch) {
+        print("#ifndef %?BATCH_WIDTH\n");
+        print("#define %?BATCH_WIDTH 16\n");
+        print("#endif\n\n");
+    }
 }
 
 static void emit_includes(void)
 {
     print("#include <assert.h>\n");
+    if (parallel || pipeline)
+        print("#include <pthread.h>\n");
+    if (ring)
+        print("#include <stdio.h>\n");
     print("#include <stdlib.h>\n");
     print("#include <string.h>\n");
     print("\n");
 }
 
+/* growable array of 32-bit words */
+struct words {
+    uint32_t *w;
+    size_t n, cap;
+};
+
+static size_t wput(struct words *v, const void *data, size_t size)
+{
+    size_t n = (size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    size_t at = v->n;
+
+    if (v->n + n > v->cap) {
+        while (v->n + n > v->cap)
+            v->cap = v->cap ? v->cap * 2 : 256;
+        v->w = realloc(v->w, v->cap * sizeof(uint32_t));
+    }
+    memset(v->w + v->n, 0, n * sizeof(uint32_t));
+    memcpy(v->w + v->n, data, size);
+    v->n += n;
+    return at;
+}
+
+static size_t wput1(struct words *v, int32_t x)
+{
+    return wput(v, &x, sizeof(x));
+}
+
+/* strings are byte offsets, kept in a separate buffer. */
+static int32_t sput(char **buf, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    int32_t at = *len;
+
+    *buf = realloc(*buf, *len + n);
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    return at;
+}
+
+/* string form of %P */
+static char *sprint_pattern(struct pattern *p, char *bp)
+{
+    strcpy(bp, ((struct term *)p->op)->name);
+    bp += strlen(bp);
+    for (int i = 0; i < p->nkids; i++) {
+        strcpy(bp, i ? ", " : "(");
+        bp = sprint_pattern(p->kids[i], bp + strlen(bp));
+    }
+    if (p->nkids)
+        *bp++ = ')';
+    *bp = 0;
+    return bp;
+}
+
+/* pre-order, see also: struct burg_pattern */
+static void put_pattern(struct words *v, struct pattern *p)
+{
+    struct term *t = p->op;
+    struct burg_pattern bp;
+
+    if (t->kind == TERM) {
+        bp.op = t->id;
+        bp.nkids = p->nkids;
+    } else {
+        bp.op = ((struct nonterm *)t)->number;
+        bp.nkids = -1;
+    }
+    wput(v, &bp, sizeof(bp));
+    for (int i = 0; i < p->nkids; i++)
+        put_pattern(v, p->kids[i]);
+}
+
+static void put_nts(struct words *v, struct pattern *p, int *n)
+{
+    struct term *t = p->op;
+
+    if (t->kind == TERM) {
+        for (int i = 0; i < p->nkids; i++)
+            put_nts(v, p->kids[i], n);
+    } else {
+        wput1(v, ((struct nonterm *)t)->number);
+        (*n)++;
+    }
+}
+
+/*
+  Write the grammar as binary tables (see burgrt.h), which the runtime
+  library labels trees with.
+ */
+static void emit_binary(void)
+{
+    struct words sec[BURG_NUM_SECTIONS];
+    struct burg_header h;
+    char *strs = NULL;
+    size_t slen = 0;
+    int max = 0;
+
+    memset(sec, 0, sizeof(sec));
+    memset(&h, 0, sizeof(h));
+    sput(&strs, &slen, "");
+
+    for (struct term *t = terms; t; t = t->link) {
+        struct burg_term bt;
+        bt.name = sput(&strs, &slen, t->name);
+        bt.id = t->id;
+        bt.nkids = t->nkids > 0 ? t->nkids : 0;
+        bt.rules = sec[BURG_SEC_TERM_RULES].n;
+        bt.nrules = 0;
+        for (struct rule *r = t->rules; r; r = r->tlink, bt.nrules++)
+            wput1(&sec[BURG_SEC_TERM_RULES], r->ern - 1);
+        wput(&sec[BURG_SEC_TERMS], &bt, sizeof(bt));
+    }
+
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link) {
+        struct burg_nonterm bn;
+        bn.name = sput(&strs, &slen, nt->name);
+        bn.number = nt->number;
+        bn.nrules = nt->nrules;
+        bn.chain = sec[BURG_SEC_CHAINS].n;
+        bn.nchain = 0;
+        for (struct rule *r = nt->chain; r; r = r->chain, bn.nchain++)
+            wput1(&sec[BURG_SEC_CHAINS], r->ern - 1);
+        wput(&sec[BURG_SEC_NONTERMS], &bn, sizeof(bn));
+    }
+
+    for (struct rule *r = rules; r; r = r->link) {
+        struct burg_rule br;
+        char buf[1024];
+        int n = 0;
+
+        sprint_pattern(r->pattern, buf + sprintf(buf, "%s: ", r->nterm->name));
+        br.name = sput(&strs, &slen, buf);
+        br.template = r->template ? sput(&strs, &slen, r->template) : 0;
+        br.lhs = r->nterm->number;
+        br.irn = r->irn;
+        br.pattern = sec[BURG_SEC_PATTERNS].n / 2;
+        put_pattern(&sec[BURG_SEC_PATTERNS], r->pattern);
+        br.nts = sec[BURG_SEC_NTS].n;
+        put_nts(&sec[BURG_SEC_NTS], r->pattern, &n);
+        wput1(&sec[BURG_SEC_NTS], 0);
+        max = n > max ? n : max;
+        br.cost = r->cost;
+        br.flags = (r->cost == -1 ? BURG_RULE_DYNAMIC : 0) |
+            (is_instruction(r) ? BURG_RULE_INSTRUCTION : 0);
+        wput(&sec[BURG_SEC_RULES], &br, sizeof(br));
+    }
+
+    wput(&sec[BURG_SEC_STRINGS], strs, slen);
+
+    h.magic = BURG_MAGIC;
+    h.version = BURG_VERSION;
+    h.max_nts = max;
+    h.size = sizeof(h);
+    for (int i = 0; i < BURG_NUM_SECTIONS; i++) {
+        h.sections[i].offset = h.size / sizeof(uint32_t);
+        h.size += sec[i].n * sizeof(uint32_t);
+    }
+    h.sections[BURG_SEC_STRINGS].count = slen;
+    h.sections[BURG_SEC_TERMS].count = num_terms;
+    h.sections[BURG_SEC_NONTERMS].count = num_nonterms;
+    h.sections[BURG_SEC_RULES].count = num_rules;
+    h.sections[BURG_SEC_PATTERNS].count = sec[BURG_SEC_PATTERNS].n / 2;
+    h.sections[BURG_SEC_TERM_RULES].count = sec[BURG_SEC_TERM_RULES].n;
+    h.sections[BURG_SEC_CHAINS].count = sec[BURG_SEC_CHAINS].n;
+    h.sections[BURG_SEC_NTS].count = sec[BURG_SEC_NTS].n;
+
+    owrite(out, &h, sizeof(h));
+    for (int i = 0; i < BURG_NUM_SECTIONS; i++)
+        owrite(out, sec[i].w, sec[i].n * sizeof(uint32_t));
+}
+
+/* a fresh output, see also: commit */
+static struct outbuf *open_output(void)
+{
+    struct outbuf *b = calloc(1, sizeof(*b));
+
+    if (b == NULL)
+        die("out of memory");
+    return b;
+}
+
+static void close_output(struct outbuf *b)
+{
+    free(b->data);
+    free(b);
+}
+
+/* write `b' to `fp' in large blocks */
+static int write_output(struct outbuf *b, FILE *fp)
+{
+    setvbuf(fp, NULL, _IONBF, 0);
+    return (b->len && fwrite(b->data, 1, b->len, fp) != b->len) || fflush(fp);
+}
+
+/* `b' is identical to the contents of `path' */
+static int same_output(struct outbuf *b, const char *path)
+{
+    FILE *old = fopen(path, "rb");
+    char buf[1 << 16];
+    size_t n, off = 0;
+    int same = old != NULL;
+
+    while (same && (n = fread(buf, 1, sizeof(buf), old)) > 0) {
+        if (n > b->len - off || memcmp(b->data + off, buf, n))
+            same = 0;
+        off += n;
+    }
+    if (old) {
+        same = same && off == b->len && !ferror(old);
+        fclose(old);
+    }
+    return same;
+}
+
+/*
+  Write `b' to `path', leaving `path' untouched if it's identical.
+  The output goes to `path.tmp' first and is renamed over `path', so
+  readers never see a partial file.
+ */
+static void commit(struct outbuf *b, const char *path)
+{
+    char *tmp;
+    FILE *fp;
+
+    if (same_output(b, path)) {
+        close_output(b);
+        return;
+    }
+    tmp = format("%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL)
+        die("can't open file '%s' for output", tmp);
+    if (write_output(b, fp) | fclose(fp)) {
+        remove(tmp);
+        die("write error: '%s'", path);
+    }
+    if (rename(tmp, path)) {
+        remove(tmp);
+        die("can't rename '%s' to '%s'", tmp, path);
+    }
+    free(tmp);
+    close_output(b);
+}
+
+/* write `out' to `path', or to stdout if NULL */
+static void finish_output(const char *path)
+{
+    if (path)
+        commit(out, path);
+    else if (write_output(out, stdout))
+        die("write error");
+}
+
+/* copy the text left in stdin (the epilogue) to `out' in blocks */
+static void emit_epilogue(void)
+{
+    char buf[1 << 16];
+    size_t n;
+
+    if (feof(stdin))
+        return;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        owrite(out, buf, n);
+}
+
+/* assign terms to `split' label partitions of similar size */
+static void partition(void)
+{
+    int total = 0, sum = 0;
+
+    for (struct term *t = terms; t; t = t->link)
+        for (struct rule *r = t->rules; r; r = r->tlink)
+            total++;
+    for (struct term *t = terms; t; t = t->link) {
+        t->part = (long)sum * split / (total + 1);
+        for (struct rule *r = t->rules; r; r = r->tlink)
+            sum++;
+    }
+}
+
+/* extern declarations of tables and functions for the shared header */
+static void emit_split_externs(void)
+{
+    if (flat) {
+        print("extern short %?nts_flat[];\n");
+        print("extern %s %?nts_offset[];\n", flat_type(flat_len));
+        print("extern %s %?kid_paths[];\n", flat_paths_type());
+    } else {
+        print("extern short *%?nts[];\n");
+    }
+    print("extern const char *%?nt_names[];\n");
+    print("extern const char *%?rule_names[];\n");
+    print("extern const char *%?templates[];\n");
+    print("extern char %?is_instruction[];\n");
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        print("extern short %?%K_rules[];\n", nt);
+    print("\n");
+    print("extern int %?rule(void *state, int nt);\n");
+    print("extern void %?label(%s *t);\n", node_type);
+    print("extern void %?kids(%s *p, int ruleno, %s *kids[]);\n",
+          node_type, node_type);
+    for (int i = 0; i < split; i++)
+        print("extern void %?label_%d(%s *t, struct %?state *p);\n", i, node_type);
+    print("\n");
+}
+
+/*
+  -split N writes the output as several files, named after `ofile':
+
+  base.h          prologue, macros, types and declarations
+  base.c          tables, ?rule, ?label, ?kids and the text left
+  base_closure.c  closures
+  base_labelK.c   the cases of ?label for partition K (0 <= K < N)
+
+  Every file includes base.h, prologue and all, so a function or
+  variable the prologue defines is defined in every file: copies if it
+  is static, a link error if not. The epilogue goes to base.c only. Not
+  with -T, whose ?trace is defined there but called from every file.
+
+  Files whose content didn't change are left untouched.
+ */
+static void emit_split(const char *ofile)
+{
+    const char *dot = strrchr(ofile, '.');
+    const char *slash = strrchr(ofile, '/');
+    char *base, *name, *guard;
+
+    if (dot == NULL || (slash && dot < slash))
+        dot = ofile + strlen(ofile);
+    base = xstrndup(ofile, dot - ofile);
+    name = slash ? xstrdup(slash + 1) : xstrdup(ofile);
+    name[strlen(name) - strlen(dot)] = 0;
+    guard = format("%s_H", name);
+    for (char *p = guard; *p; p++)
+        *p = isalnum((unsigned char)*p) ? toupper((unsigned char)*p) : '_';
+
+    partition();
+
+    /* header */
+    out = open_output();
+    print("#ifndef %s\n#define %s\n", guard, guard);
+    if (prologue_buf)
+        print("%s", prologue_buf);
+    print("\n/* [BEGIN] Code generated automatically. */\n\n");
+    emit_includes();
+    emit_macros();
+    emit_types();
+    emit_macro_nts();
+    emit_split_externs();
+    emit_forwards();
+    print("/* [END] Code generated automatically. */\n\n");
+    print("#endif\n");
+    commit(out, format("%s.h", base));
+
+    /* tables and entries */
+    out = open_output();
+    print("#include \"%s.h\"\n", name);
+    print("\n/* [BEGIN] Code generated automatically. */\n\n");
+    emit_variables();
+    emit_func_rule();
+    emit_func_label();
+    emit_func_kids();
+    print("\n/* [END] Code generated automatically. */\n\n");
+    emit_epilogue();
+    commit(out, format("%s.c", base));
+
+    /* closures */
+    out = open_output();
+    print("#include \"%s.h\"\n\n", name);
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link)
+        if (nt->chain)          /* has closure */
+            emit_func_closure(nt);
+    commit(out, format("%s_closure.c", base));
+
+    /* label partitions */
+    for (int i = 0; i < split; i++) {
+        out = open_output();
+        print("#include \"%s.h\"\n\n", name);
+        emit_func_label_part(i);
+        commit(out, format("%s_label%d.c", base, i));
+    }
+}
+
+/* --stats */
+enum { PHASE_PARSE, PHASE_BUILD, PHASE_EMIT, NUM_PHASES };
+static const char *phase_names[] = { "parse", "build", "emit" };
+static double phase_times[NUM_PHASES];
+static clock_t phase_clock;
+
+/* end of `phase' */
+static void phase(int phase)
+{
+    clock_t now = clock();
+
+    phase_times[phase] += (double)(now - phase_clock) / CLOCKS_PER_SEC;
+    phase_clock = now;
+}
+
+static int pattern_depth(struct pattern *p)
+{
+    int depth = 0;
+
+    for (int i = 0; i < p->nkids; i++) {
+        int d = pattern_depth(p->kids[i]);
+        if (d > depth)
+            depth = d;
+    }
+    return depth + 1;
+}
+
+/* longest chain of chain rules from `nt', cycles are cut */
+static int closure_depth(struct nonterm *nt, char *visiting)
+{
+    int depth = 0;
+
+    if (visiting[nt->number])
+        return 0;
+    visiting[nt->number] = 1;
+    for (struct rule *r = nt->chain; r; r = r->chain) {
+        int d = closure_depth(r->nterm, visiting) + 1;
+        if (d > depth)
+            depth = d;
+    }
+    visiting[nt->number] = 0;
+    return depth;
+}
+
+/* count distinct strings of `strs' and sum their `lens' into `sum' if not NULL */
+static int count_distinct(char **strs, int *lens, int n, int *sum)
+{
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        int j;
+        for (j = 0; j < i && strcmp(strs[i], strs[j]); j++)
+            ;
+        if (j == i) {
+            count++;
+            if (sum)
+                *sum += lens[i];
+        }
+    }
+    return count;
+}
+
+/* sizes of the fields of struct ?state, see emit_types */
+struct state_layout {
+    size_t size, align;
+    size_t costs, derive, need, rule, share;
+};
+
+/* add `n' fields of `size' bytes, aligned to `align', returns their size */
+static size_t layout_field(struct state_layout *l, size_t size, size_t align, size_t n)
+{
+    l->size = (l->size + align - 1) / align * align + size * n;
+    if (align > l->align)
+        l->align = align;
+    return size * n;
+}
+
+/* the layout emit_types emits */
+static void layout_state(struct state_layout *l)
+{
+    int m = num_models > 1 ? num_models : 1;
+    int units = 0, bits_used = 0;
+
+    memset(l, 0, sizeof(*l));
+    /* bit-fields of `rule' don't straddle an unsigned int */
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link) {
+        int b = bits(nt->nrules);
+        if (!units || bits_used + b > 32) {
+            units++;
+            bits_used = 0;
+        }
+        bits_used += b;
+    }
+    l->costs = layout_field(l, sizeof(short), sizeof(short), (num_nonterms + 1) * m);
+    l->derive = layout_field(l, sizeof(unsigned int), sizeof(unsigned int),
+                             (num_nonterms / 32 + 1) * m);
+    if (need)
+        l->need = layout_field(l, sizeof(short), sizeof(short), (num_nonterms + 1) * m);
+    l->rule = layout_field(l, sizeof(unsigned int) * units, sizeof(unsigned int), m);
+    if (share) {
+        l->share = layout_field(l, sizeof(int), sizeof(int), 1);
+        if (share_deep && max_kids > 0)
+            l->share += layout_field(l, sizeof(void *), sizeof(void *), max_kids);
+        l->share += layout_field(l, sizeof(void *), sizeof(void *), 1);
+        l->share += layout_field(l, sizeof(unsigned int), sizeof(unsigned int), 1);
+    }
+    l->size = (l->size + l->align - 1) / l->align * l->align;
+}
+
+static void report_stats(void)
+{
+    char **nts = NEWARRAY(sizeof(char *), num_rules);
+    char **kids = NEWARRAY(sizeof(char *), num_rules);
+    int *lens = NEWARRAY(sizeof(int), num_rules);
+    char *visiting = NEWARRAY(1, num_nonterms + 1);
+    int i = 0, n, entries = 0, cases;
+    struct state_layout l;
+
+    for (struct rule *r = rules; r; r = r->link, i++) {
+        char buf[1024];
+        int j = 0;
+
+        *compute_nts(r->pattern, buf, &j) = 0;
+        nts[i] = xstrdup(buf);
+        lens[i] = j + 1;
+        j = 0;
+        *compute_kids(r->pattern, "p", buf, &j) = 0;
+        kids[i] = xstrdup(buf);
+    }
+    layout_state(&l);
+
+    fprintf(stderr, "%s: terms %u, nonterms %u, rules %u, max kids %d, max nts %d\n",
+            progname, num_terms, num_nonterms, num_rules, max_kids, max_nts);
+    fprintf(stderr, "state: %zu bytes (costs %zu, derive %zu", l.size, l.costs, l.derive);
+    if (need)
+        fprintf(stderr, ", need %zu", l.need);
+    fprintf(stderr, ", rule %zu", l.rule);
+    if (share)
+        fprintf(stderr, ", share %zu", l.share);
+    fprintf(stderr, ")\n");
+    n = count_distinct(nts, lens, num_rules, &entries);
+    cases = count_distinct(kids, lens, num_rules, NULL);
+    fprintf(stderr, "tables: nts %d arrays, %d entries; kids %d cases", n, entries, cases);
+    if (flat)
+        fprintf(stderr, "; flat %d entries", flat_len);
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "operators:\n");
+    for (struct term *t = terms; t; t = t->link) {
+        int n = 0, conds = 0, depth = 0;
+
+        for (struct rule *r = t->rules; r; r = r->tlink, n++) {
+            if (r->pattern->nterms - 1 > conds)
+                conds = r->pattern->nterms - 1;
+            if (pattern_depth(r->pattern) > depth)
+                depth = pattern_depth(r->pattern);
+        }
+        fprintf(stderr, "  %-16s rules %3d, conds %2d, depth %2d\n",
+                t->name, n, conds, depth);
+    }
+    fprintf(stderr, "nonterms:\n");
+    for (struct nonterm *nt = nonterms; nt; nt = nt->link) {
+        int fanout = 0;
+
+        for (struct rule *r = nt->chain; r; r = r->chain)
+            fanout++;
+        fprintf(stderr, "  %-16s rules %3u, chain %3d, closure depth %2d\n",
+                nt->name, nt->nrules, fanout, closure_depth(nt, visiting));
+    }
+    fprintf(stderr, "time:");
+    for (i = 0; i < NUM_PHASES; i++)
+        fprintf(stderr, "%s %s %.3fs", i ? "," : "", phase_names[i], phase_times[i]);
+    fprintf(stderr, "\n");
+}
+
 static void usage(void)
 {
     fprintf(stderr,
@@ -942,6 +3869,24 @@ static void usage(void)
             "  -o <file>             Write output to <file>\n"
             "  -prefix <prefix>      Using <prefix> as prefix for generated names\n"
             "  -T                    Generate trace function calls\n"
+            "  -ring <n>             Record traces in a per-thread ring buffer of <n>\n"
+            "                        events, enabled at run time by _trace_on\n"
+            "  -B                    Generate binary tables for the runtime library\n"
+            "  -cxx                  Generate a C++ header with a templated labeler\n"
+            "  -flat                 Encode _nts and _kids as flat, offset indexed tables\n"
+            "  -share                Share one state among nodes labeled alike\n"
+            "  -array                Label post-order node arrays into a state array\n"
+            "  -parallel             Generate _plabel to label large trees on threads\n"
+            "  -context              Keep states in a labeling context, not in nodes\n"
+            "  -need                 Compute register needs and generate _kids_ordered\n"
+            "  -batch                Generate _label_batch to label many trees at once\n"
+            "  -pipeline             Generate _pipeline to label a tree while reducing\n"
+            "                        the one before, recycling their states\n"
+            "  -const                Share constant states among leaves with literal costs\n"
+            "  -split <n>            Split output into a header and sources with <n>\n"
+            "                        label partitions, named after the -o file; the\n"
+            "                        prologue goes to the header and must only declare\n"
+            "  --stats               Report table sizes and generated code cost to stderr\n"
             "  --help                Display available options\n"
             "  --version             Display version number\n",
             progname);
@@ -968,6 +3913,43 @@ int main(int argc, char *argv[])
             prefix = argv[i];
         } else if (!strcmp(arg, "-T")) {
             trace = 1;
+        } else if (!strcmp(arg, "-ring")) {
+            if (++i >= argc)
+                die("missing size while -ring specified");
+            if (atoi(argv[i]) < 1)
+                die("ring size must be positive");
+            ring = atoi(argv[i]);
+        } else if (!strcmp(arg, "-B")) {
+            binary = 1;
+        } else if (!strcmp(arg, "-split")) {
+            if (++i >= argc)
+                die("missing partitions while -split specified");
+            split = atoi(argv[i]);
+            if (split < 1)
+                die("number of partitions must be positive");
+        } else if (!strcmp(arg, "-flat")) {
+            flat = 1;
+        } else if (!strcmp(arg, "-need")) {
+            need = 1;
+        } else if (!strcmp(arg, "-batch")) {
+            batch = 1;
+        } else if (!strcmp(arg, "-pipeline")) {
+            pipeline = 1;
+        } else if (!strcmp(arg, "-const")) {
+            const_leaves = 1;
+        } else if (!strcmp(arg, "-context")) {
+            context = 1;
+        } else if (!strcmp(arg, "-parallel")) {
+            parallel = 1;
+        } else if (!strcmp(arg, "-array")) {
+            array = 1;
+        } else if (!strcmp(arg, "-share")) {
+            share = 1;
+        } else if (!strcmp(arg, "-cxx")) {
+            cxx = 1;
+            node_type = "node_type";
+        } else if (!strcmp(arg, "--stats")) {
+            stats = 1;
         } else if (!strcmp(arg, "--help")) {
             usage();
         } else if (!strcmp(arg, "--version")) {
@@ -987,17 +3969,70 @@ int main(int argc, char *argv[])
         perror("can't read input file");
         exit(EXIT_FAILURE);
     }
-    if (ofile && !freopen(ofile, "w", stdout)) {
-        perror("can't open file for output");
-        exit(EXIT_FAILURE);
-    }
-
+    if (split && !ofile)
+        die("-split requires -o");
+    if (split && (cxx || binary || trace))
+        die("-split can't be used with -cxx, -B or -T");
+    if (ring && (split || cxx || trace))
+        die("-ring can't be used with -split, -cxx or -T");
+    if (need && (split || cxx))
+        die("-need can't be used with -split or -cxx");
+    if (const_leaves && (trace || ring || split || cxx || share || array || context))
+        die("-const can't be used with -T, -ring, -split, -cxx, -share, -array or -context");
+    if (pipeline && (split || cxx || share || array || context || parallel || batch))
+        die("-pipeline can't be used with -split, -cxx, -share, -array, -context, -parallel or -batch");
+    if (batch && (split || cxx || share || array || context || parallel || need || trace || ring))
+        die("-batch can't be used with -split, -cxx, -share, -array, -context, -parallel, -need, -T or -ring");
+    if (context && (split || cxx || share || array || parallel))
+        die("-context can't be used with -split, -cxx, -share, -array or -parallel");
+    if (parallel && (split || cxx || share || array))
+        die("-parallel can't be used with -split, -cxx, -share or -array");
+    if (array && (split || cxx || share))
+        die("-array can't be used with -split, -cxx or -share");
+    if (share && (split || cxx))
+        die("-share can't be used with -split or -cxx");
+    out = open_output();
+
+    phase_clock = clock();
     if ((ret = yyparse()))
         die("parser failed with code: %d", ret);
+    phase(PHASE_PARSE);
 
     /* check start symbol */
     if (!start || !start->rules)
         die("missing 'start' rule");
+    if (num_models > 1 && (split || cxx || share || batch))
+        die("several cost models can't be used with -split, -cxx, -share or -batch");
+
+    if (binary) {
+        emit_binary();
+        finish_output(ofile);
+        phase(PHASE_EMIT);
+        if (stats)
+            report_stats();
+        return 0;
+    }
+
+    if (flat)
+        build_flat();
+    if (share)
+        build_share();
+    if (const_leaves)
+        build_leaves();
+    phase(PHASE_BUILD);
+
+    if (split) {
+        emit_split(ofile);
+        phase(PHASE_EMIT);
+        if (stats)
+            report_stats();
+        return 0;
+    }
+
+    if (cxx)
+        print("#pragma once\n");
+    if (prologue_buf)
+        oputs(prologue_buf, out);
 
     print("\n/* [BEGIN] Code generated automatically. */\n\n");
 
@@ -1011,11 +4046,11 @@ int main(int argc, char *argv[])
     print("\n/* [END] Code generated automatically. */\n\n");
 
     /* emit text left */
-    if (!feof(stdin)) {
-        int c;
-        while ((c = getc(stdin)) != EOF)
-            putc(c, stdout);
-    }
+    emit_epilogue();
 
+    finish_output(ofile);
+    phase(PHASE_EMIT);
+    if (stats)
+        report_stats();
     return 0;
 }
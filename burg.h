@@ -10,6 +10,9 @@ struct term {
     int id;
     int nkids;
     struct rule *rules;         /* rules whose pattern starts with term */
+    int part;                   /* label partition (-split) */
+    int raw;                    /* states keep raw costs (-share) */
+    struct leaf *leaf;          /* constant state, see build_leaves */
     struct term *link;          /* next term (sorted by id) */
 };
 
@@ -26,8 +29,9 @@ struct nonterm {
 
 struct pattern {
     void *op;                   /* a term or nonterm */
-    struct pattern *left;
-    struct pattern *right;
+    int nkids;
+    struct pattern **kids;
+    struct pattern *link;       /* next sibling (while parsing) */
     int nterms;                 /* number of terms */
 };
 
@@ -37,6 +41,9 @@ struct rule {
     char *template;
     char *code;            /* cost code */
     int cost;              /* -1 if cost is not integer literal */
+    int regs;              /* registers of the result, -1 if not given */
+    char **codes;          /* code and cost per cost model (%costs) */
+    int *costs;
     int ern;               /* external rule number (in all rules) */
     int irn;               /* internal rule number (in the same nonterm) */
     struct rule *tlink;    /* next rule with the same pattern root (term) */
@@ -51,7 +58,9 @@ extern char *xstrdup(const char *);
 extern char *xstrndup(const char *, size_t);
 extern struct nonterm *nonterm(char *);
 extern struct term *term(char *, int);
-extern struct pattern *pattern(char *, struct pattern *, struct pattern *);
+extern struct pattern *pattern(char *, struct pattern *);
 extern struct rule *rule(char *, struct pattern *, char *, char *);
+extern void cost_model(char *);
+extern void prologue(int);
 
 #endif
@@ -0,0 +1,426 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "burgrt.h"
+
+struct burg_grammar {
+    const void *base;
+    size_t size;
+    int mapped;                 /* base is mmap(2)ed */
+    const struct burg_header *header;
+    const char *strings;
+    const struct burg_term *terms;
+    const struct burg_nonterm *nonterms;
+    const struct burg_rule *rules;
+    const struct burg_pattern *patterns;
+    const int32_t *term_rules;
+    const int32_t *chains;
+    const int32_t *nts;
+    int num_terms;
+    int num_nonterms;
+    int num_rules;
+    int num_patterns;
+    int num_nts;
+};
+
+/*
+  state layout:
+
+  int16_t costs[num_nonterms + 1];
+  uint16_t rules[num_nonterms + 1];   (external rule numbers)
+ */
+#define STATE_COSTS(g, s)   ((int16_t *)(s))
+#define STATE_RULES(g, s)   ((uint16_t *)((int16_t *)(s) + (g)->num_nonterms + 1))
+#define STATE_SIZE(g)       (((g)->num_nonterms + 1) * (sizeof(int16_t) + sizeof(uint16_t)))
+
+static const void *section(const struct burg_header *h, size_t size,
+                           int sec, size_t entsize)
+{
+    size_t off = (size_t)h->sections[sec].offset * sizeof(uint32_t);
+    size_t len = (size_t)h->sections[sec].count * entsize;
+
+    if (off < sizeof(struct burg_header) || off > size || len > size - off)
+        return NULL;
+    return (const char *)h + off;
+}
+
+static int valid_string(const struct burg_grammar *g, int32_t off)
+{
+    return off >= 0 && off < g->header->sections[BURG_SEC_STRINGS].count;
+}
+
+/* Returns the index following the pattern at `i', or -1 if malformed. */
+static int skip_pattern(const struct burg_grammar *g, int i)
+{
+    const struct burg_pattern *p;
+
+    if (i < 0 || i >= g->num_patterns)
+        return -1;
+    p = &g->patterns[i++];
+    for (int k = 0; k < p->nkids && i >= 0; k++)
+        i = skip_pattern(g, i);
+    return i;
+}
+
+static int validate(struct burg_grammar *g)
+{
+    int i;
+
+    /* strings must be terminated */
+    if (g->header->sections[BURG_SEC_STRINGS].count &&
+        g->strings[g->header->sections[BURG_SEC_STRINGS].count - 1])
+        return 0;
+    for (i = 0; i < g->num_terms; i++) {
+        const struct burg_term *t = &g->terms[i];
+        if (!valid_string(g, t->name) ||
+            t->nkids < 0 || t->rules < 0 || t->nrules < 0 ||
+            t->rules + t->nrules > g->header->sections[BURG_SEC_TERM_RULES].count)
+            return 0;
+        if (i && g->terms[i - 1].id >= t->id)
+            return 0;
+    }
+    for (i = 0; i < g->num_nonterms; i++) {
+        const struct burg_nonterm *nt = &g->nonterms[i];
+        if (!valid_string(g, nt->name) || nt->number != i + 1 ||
+            nt->chain < 0 || nt->nchain < 0 ||
+            nt->chain + nt->nchain > g->header->sections[BURG_SEC_CHAINS].count)
+            return 0;
+    }
+    /* rule numbers are stored in 16 bits */
+    if (g->num_rules > UINT16_MAX)
+        return 0;
+    for (i = 0; i < g->num_rules; i++) {
+        const struct burg_rule *r = &g->rules[i];
+        if (!valid_string(g, r->name) || !valid_string(g, r->template) ||
+            r->lhs < 1 || r->lhs > g->num_nonterms ||
+            r->pattern < 0 || r->pattern >= g->num_patterns ||
+            r->nts < 0 || r->nts >= g->num_nts ||
+            skip_pattern(g, r->pattern) < 0)
+            return 0;
+    }
+    for (i = 0; i < g->num_patterns; i++) {
+        const struct burg_pattern *p = &g->patterns[i];
+        if (p->nkids < 0 && (p->op < 1 || p->op > g->num_nonterms))
+            return 0;
+    }
+    for (i = 0; i < g->header->sections[BURG_SEC_TERM_RULES].count; i++)
+        if (g->term_rules[i] < 0 || g->term_rules[i] >= g->num_rules)
+            return 0;
+    for (i = 0; i < g->header->sections[BURG_SEC_CHAINS].count; i++)
+        if (g->chains[i] < 0 || g->chains[i] >= g->num_rules)
+            return 0;
+    for (i = 0; i < g->num_nts; i++)
+        if (g->nts[i] < 0 || g->nts[i] > g->num_nonterms)
+            return 0;
+    if (g->num_nts && g->nts[g->num_nts - 1])
+        return 0;
+    return 1;
+}
+
+/* `data' must stay valid and 4-byte aligned until burg_close. */
+struct burg_grammar *burg_load(const void *data, size_t size)
+{
+    const struct burg_header *h = data;
+    struct burg_grammar *g;
+
+    if (size < sizeof(struct burg_header) ||
+        h->magic != BURG_MAGIC || h->version != BURG_VERSION ||
+        h->size > size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    g = calloc(1, sizeof(struct burg_grammar));
+    if (g == NULL)
+        return NULL;
+    g->base = data;
+    g->size = h->size;
+    g->header = h;
+    g->strings = section(h, h->size, BURG_SEC_STRINGS, 1);
+    g->terms = section(h, h->size, BURG_SEC_TERMS, sizeof(struct burg_term));
+    g->nonterms = section(h, h->size, BURG_SEC_NONTERMS, sizeof(struct burg_nonterm));
+    g->rules = section(h, h->size, BURG_SEC_RULES, sizeof(struct burg_rule));
+    g->patterns = section(h, h->size, BURG_SEC_PATTERNS, sizeof(struct burg_pattern));
+    g->term_rules = section(h, h->size, BURG_SEC_TERM_RULES, sizeof(int32_t));
+    g->chains = section(h, h->size, BURG_SEC_CHAINS, sizeof(int32_t));
+    g->nts = section(h, h->size, BURG_SEC_NTS, sizeof(int32_t));
+    g->num_terms = h->sections[BURG_SEC_TERMS].count;
+    g->num_nonterms = h->sections[BURG_SEC_NONTERMS].count;
+    g->num_rules = h->sections[BURG_SEC_RULES].count;
+    g->num_patterns = h->sections[BURG_SEC_PATTERNS].count;
+    g->num_nts = h->sections[BURG_SEC_NTS].count;
+
+    if (!g->strings || !g->terms || !g->nonterms || !g->rules ||
+        !g->patterns || !g->term_rules || !g->chains || !g->nts ||
+        !validate(g)) {
+        free(g);
+        errno = EINVAL;
+        return NULL;
+    }
+    return g;
+}
+
+struct burg_grammar *burg_open(const char *path)
+{
+    struct burg_grammar *g;
+    struct stat st;
+    void *base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    g = burg_load(base, st.st_size);
+    if (g == NULL) {
+        int e = errno;
+        munmap(base, st.st_size);
+        errno = e;
+        return NULL;
+    }
+    g->mapped = 1;
+    g->size = st.st_size;
+    return g;
+}
+
+void burg_close(struct burg_grammar *g)
+{
+    if (g == NULL)
+        return;
+    if (g->mapped)
+        munmap((void *)g->base, g->size);
+    free(g);
+}
+
+static const struct burg_term *find_term(const struct burg_grammar *g, int op)
+{
+    int lo = 0, hi = g->num_terms - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (g->terms[mid].id < op)
+            lo = mid + 1;
+        else if (g->terms[mid].id > op)
+            hi = mid - 1;
+        else
+            return &g->terms[mid];
+    }
+    return NULL;
+}
+
+static int rule_cost(const struct burg_node_ops *ops, void *node,
+                     const struct burg_rule *r, int ruleno)
+{
+    if (!(r->flags & BURG_RULE_DYNAMIC))
+        return r->cost;
+    /* dynamic costs can't be evaluated without the callback */
+    return ops->cost ? ops->cost(node, ruleno) : BURG_MAX_COST;
+}
+
+static void record(const struct burg_grammar *g, const struct burg_node_ops *ops,
+                   void *node, void *state, int ruleno, int c);
+
+/* chain rules whose rhs is `nt' */
+static void closure(const struct burg_grammar *g, const struct burg_node_ops *ops,
+                    void *node, void *state, int nt, int c)
+{
+    const struct burg_nonterm *n = &g->nonterms[nt - 1];
+
+    for (int i = n->chain; i < n->chain + n->nchain; i++) {
+        int ruleno = g->chains[i] + 1;
+        const struct burg_rule *r = &g->rules[ruleno - 1];
+        record(g, ops, node, state, ruleno, c + rule_cost(ops, node, r, ruleno));
+    }
+}
+
+static void record(const struct burg_grammar *g, const struct burg_node_ops *ops,
+                   void *node, void *state, int ruleno, int c)
+{
+    const struct burg_rule *r = &g->rules[ruleno - 1];
+    int16_t *costs = STATE_COSTS(g, state);
+
+    if (c < costs[r->lhs]) {
+        costs[r->lhs] = c;
+        STATE_RULES(g, state)[r->lhs] = ruleno;
+        closure(g, ops, node, state, r->lhs, c);
+    }
+}
+
+/*
+  Match the pattern at `i' against `node' and sum the costs of its
+  nonterm leaves into `*c'. The root op has been checked by the caller.
+
+  Returns the index following the pattern, or -1 if not matched.
+ */
+static int match(const struct burg_grammar *g, const struct burg_node_ops *ops,
+                 int i, void *node, int root, int *c)
+{
+    const struct burg_pattern *p = &g->patterns[i++];
+
+    if (p->nkids < 0) {
+        *c += STATE_COSTS(g, *ops->state(node))[p->op];
+        return i;
+    }
+    if (!root && ops->op(node) != p->op)
+        return -1;
+    for (int k = 0; k < p->nkids; k++) {
+        i = match(g, ops, i, ops->kid(node, k), 0, c);
+        if (i < 0)
+            return -1;
+    }
+    return i;
+}
+
+void burg_label(const struct burg_grammar *g, const struct burg_node_ops *ops,
+                void *node)
+{
+    const struct burg_term *t;
+    void *state;
+    int16_t *costs;
+
+    assert(node && "null tree");
+
+    t = find_term(g, ops->op(node));
+    if (t == NULL)
+        abort();
+    for (int i = 0; i < t->nkids; i++) {
+        assert(ops->kid(node, i));
+        burg_label(g, ops, ops->kid(node, i));
+    }
+
+    state = ops->alloc ? ops->alloc(STATE_SIZE(g)) : calloc(1, STATE_SIZE(g));
+    *ops->state(node) = state;
+    costs = STATE_COSTS(g, state);
+    for (int i = 1; i <= g->num_nonterms; i++)
+        costs[i] = BURG_MAX_COST;
+
+    for (int i = t->rules; i < t->rules + t->nrules; i++) {
+        int ruleno = g->term_rules[i] + 1;
+        const struct burg_rule *r = &g->rules[ruleno - 1];
+        int c = 0;
+
+        if (match(g, ops, r->pattern, node, 1, &c) < 0)
+            continue;
+        record(g, ops, node, state, ruleno, c + rule_cost(ops, node, r, ruleno));
+    }
+}
+
+int burg_rule(const struct burg_grammar *g, const void *state, int nt)
+{
+    if (!state)
+        return 0;
+    if (nt < 1 || nt > g->num_nonterms)
+        abort();
+    return STATE_RULES(g, state)[nt];
+}
+
+int burg_cost(const struct burg_grammar *g, const void *state, int nt)
+{
+    if (!state)
+        return BURG_MAX_COST;
+    if (nt < 1 || nt > g->num_nonterms)
+        abort();
+    return STATE_COSTS(g, state)[nt];
+}
+
+static int collect_kids(const struct burg_grammar *g,
+                        const struct burg_node_ops *ops,
+                        int i, void *node, void *kids[], int *n)
+{
+    const struct burg_pattern *p = &g->patterns[i++];
+
+    if (p->nkids < 0) {
+        kids[(*n)++] = node;
+        return i;
+    }
+    for (int k = 0; k < p->nkids; k++)
+        i = collect_kids(g, ops, i, ops->kid(node, k), kids, n);
+    return i;
+}
+
+/* Returns the number of kids written, which is the length of burg_nts. */
+int burg_kids(const struct burg_grammar *g, const struct burg_node_ops *ops,
+              void *node, int ruleno, void *kids[])
+{
+    int n = 0;
+
+    assert(node && "null tree");
+    assert(kids && "null kids for writing");
+
+    if (ruleno < 1 || ruleno > g->num_rules)
+        abort();
+    collect_kids(g, ops, g->rules[ruleno - 1].pattern, node, kids, &n);
+    return n;
+}
+
+const int32_t *burg_nts(const struct burg_grammar *g, int ruleno)
+{
+    if (ruleno < 1 || ruleno > g->num_rules)
+        return NULL;
+    return &g->nts[g->rules[ruleno - 1].nts];
+}
+
+int burg_max_nts(const struct burg_grammar *g)
+{
+    return g->header->max_nts;
+}
+
+int burg_num_rules(const struct burg_grammar *g)
+{
+    return g->num_rules;
+}
+
+int burg_num_nonterms(const struct burg_grammar *g)
+{
+    return g->num_nonterms;
+}
+
+/* Returns the nonterm number of `name', or 0 if not found. */
+int burg_nonterm(const struct burg_grammar *g, const char *name)
+{
+    for (int i = 0; i < g->num_nonterms; i++)
+        if (!strcmp(g->strings + g->nonterms[i].name, name))
+            return g->nonterms[i].number;
+    return 0;
+}
+
+const char *burg_nt_name(const struct burg_grammar *g, int nt)
+{
+    if (nt < 1 || nt > g->num_nonterms)
+        return NULL;
+    return g->strings + g->nonterms[nt - 1].name;
+}
+
+const char *burg_rule_name(const struct burg_grammar *g, int ruleno)
+{
+    if (ruleno < 1 || ruleno > g->num_rules)
+        return NULL;
+    return g->strings + g->rules[ruleno - 1].name;
+}
+
+const char *burg_template(const struct burg_grammar *g, int ruleno)
+{
+    if (ruleno < 1 || ruleno > g->num_rules)
+        return NULL;
+    return g->strings + g->rules[ruleno - 1].template;
+}
+
+int burg_is_instruction(const struct burg_grammar *g, int ruleno)
+{
+    if (ruleno < 1 || ruleno > g->num_rules)
+        return 0;
+    return (g->rules[ruleno - 1].flags & BURG_RULE_INSTRUCTION) != 0;
+}
@@ -0,0 +1,133 @@
+#ifndef BURGRT_H
+#define BURGRT_H
+
+#include <stddef.h>             /* for size_t */
+#include <stdint.h>
+
+/*
+  Binary grammar tables.
+
+  `burg -B' writes the grammar as a blob of 32-bit words in the byte
+  order of the generating host. The blob starts with a `struct burg_header'
+  whose section table gives the offset (in words, from the start of the
+  blob) and the number of entries of each section. All cross references
+  between sections are entry indexes, so the blob can be mapped read-only
+  and used in place.
+
+  Patterns are flattened in pre-order. A term node is followed by its
+  `nkids' kid patterns; a nonterm node has `nkids' set to -1.
+
+  Strings (names and templates) are NUL-terminated and stored in the
+  string section, referenced by byte offset.
+ */
+
+#define BURG_MAGIC          0x47525542 /* "BURG" */
+#define BURG_VERSION        1
+#define BURG_MAX_COST       0x7fff
+
+/* sections */
+enum {
+    BURG_SEC_STRINGS,           /* bytes */
+    BURG_SEC_TERMS,             /* struct burg_term, sorted by id */
+    BURG_SEC_NONTERMS,          /* struct burg_nonterm, indexed by number - 1 */
+    BURG_SEC_RULES,             /* struct burg_rule, indexed by ern - 1 */
+    BURG_SEC_PATTERNS,          /* struct burg_pattern */
+    BURG_SEC_TERM_RULES,        /* rule indexes, grouped by term */
+    BURG_SEC_CHAINS,            /* rule indexes, grouped by rhs nonterm */
+    BURG_SEC_NTS,               /* zero-terminated nonterm numbers */
+    BURG_NUM_SECTIONS
+};
+
+/* rule flags */
+enum {
+    BURG_RULE_DYNAMIC = 1,      /* cost is computed by `cost' callback */
+    BURG_RULE_INSTRUCTION = 2   /* template ends with "\n" */
+};
+
+struct burg_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* total size in bytes */
+    uint32_t max_nts;           /* longest nts sequence */
+    struct {
+        uint32_t offset;        /* in words */
+        uint32_t count;         /* in entries */
+    } sections[BURG_NUM_SECTIONS];
+};
+
+struct burg_term {
+    int32_t name;               /* string offset */
+    int32_t id;
+    int32_t nkids;
+    int32_t rules;              /* first index in BURG_SEC_TERM_RULES */
+    int32_t nrules;
+};
+
+struct burg_nonterm {
+    int32_t name;               /* string offset */
+    int32_t number;
+    int32_t nrules;
+    int32_t chain;              /* first index in BURG_SEC_CHAINS */
+    int32_t nchain;
+};
+
+struct burg_rule {
+    int32_t name;               /* string offset of "nt: pattern" */
+    int32_t template;           /* string offset */
+    int32_t lhs;                /* nonterm number */
+    int32_t irn;
+    int32_t pattern;            /* index in BURG_SEC_PATTERNS */
+    int32_t nts;                /* index in BURG_SEC_NTS */
+    int32_t cost;               /* -1 if BURG_RULE_DYNAMIC */
+    int32_t flags;
+};
+
+struct burg_pattern {
+    int32_t op;                 /* term id or nonterm number */
+    int32_t nkids;              /* -1 if nonterm */
+};
+
+/*
+  Runtime labeler.
+
+  The runtime labels trees with the tables of a blob. It reaches into
+  nodes through `struct burg_node_ops' only, so it works with any node
+  representation.
+
+  States are allocated with `alloc' (or calloc(3) if NULL) and are never
+  freed by the runtime.
+ */
+
+struct burg_grammar;
+
+struct burg_node_ops {
+    int (*op)(void *node);
+    void *(*kid)(void *node, int i);
+    void **(*state)(void *node);       /* address of the state field */
+    int (*cost)(void *node, int ruleno); /* dynamic costs, may be NULL */
+    void *(*alloc)(size_t size);        /* zero-filled, may be NULL */
+};
+
+extern struct burg_grammar *burg_open(const char *path);
+extern struct burg_grammar *burg_load(const void *data, size_t size);
+extern void burg_close(struct burg_grammar *g);
+
+extern void burg_label(const struct burg_grammar *g,
+                       const struct burg_node_ops *ops, void *node);
+extern int burg_rule(const struct burg_grammar *g, const void *state, int nt);
+extern int burg_cost(const struct burg_grammar *g, const void *state, int nt);
+extern int burg_kids(const struct burg_grammar *g,
+                     const struct burg_node_ops *ops,
+                     void *node, int ruleno, void *kids[]);
+
+extern const int32_t *burg_nts(const struct burg_grammar *g, int ruleno);
+extern int burg_max_nts(const struct burg_grammar *g);
+extern int burg_num_rules(const struct burg_grammar *g);
+extern int burg_num_nonterms(const struct burg_grammar *g);
+extern int burg_nonterm(const struct burg_grammar *g, const char *name);
+extern const char *burg_nt_name(const struct burg_grammar *g, int nt);
+extern const char *burg_rule_name(const struct burg_grammar *g, int ruleno);
+extern const char *burg_template(const struct burg_grammar *g, int ruleno);
+extern int burg_is_instruction(const struct burg_grammar *g, int ruleno);
+
+#endif
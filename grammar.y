@@ -14,14 +14,16 @@ static int yylex(void);
     char *sval;
     struct pattern *pval;
 }
-%token TERM PERCENT START
+%token TERM PERCENT START COSTS
 %token <sval> ID
 %token <ival> NUMBER
 %token <sval> TEMPLATE
 %token <sval> COST
 %type <pval> pattern
+%type <pval> patterns
 %type <sval> nonterm
 %type <sval> cost
+%type <ival> regs
 
 %%
 start    : decls PERCENT rules
@@ -35,6 +37,7 @@ decls    : /* empty */
 decl     : TERM idlist '\n'
          | START nonterm '\n'     { if (nonterm($2)->number != 1)
                                         yyerror("redeclaration of the start symbol"); }
+         | COSTS models '\n'
          | '\n'
          | error '\n'             { yyerrok; }
          ;
@@ -43,9 +46,13 @@ idlist   : /* empty */
          | idlist ID '=' NUMBER   { term($2, $4); }
          ;
 
+models   : ID                     { cost_model($1); }
+         | models ID              { cost_model($2); }
+         ;
+
 rules    : /* empty */
-         | rules nonterm ':' pattern TEMPLATE cost '\n'
-                                  { rule($2, $4, $5, $6); }
+         | rules nonterm ':' pattern regs TEMPLATE cost '\n'
+                                  { rule($2, $4, $6, $7)->regs = $5; }
          | rules '\n'
          | rules error '\n'       { yyerrok; }
          ;
@@ -53,12 +60,23 @@ rules    : /* empty */
 nonterm  : ID                     { nonterm($$ = $1); }
          ;
 
+regs     : /* empty */            { $$ = -1; }
+         | '[' NUMBER ']'         { $$ = $2; }
+         ;
+
 cost     : COST                   { if (*$1 == 0) $$ = "0"; }
          ;
 
-pattern  : ID                                { $$ = pattern($1, NULL, NULL); }
-         | ID '(' pattern ')'                { $$ = pattern($1, $3, NULL); }
-         | ID '(' pattern ',' pattern ')'    { $$ = pattern($1, $3, $5); }
+pattern  : ID                     { $$ = pattern($1, NULL); }
+         | ID '(' patterns ')'    { $$ = pattern($1, $3); }
+         ;
+
+patterns : pattern
+         | patterns ',' pattern   { struct pattern **p = &$1;
+                                    while (*p)
+                                        p = &(*p)->link;
+                                    *p = $3;
+                                    $$ = $1; }
          ;
 
 %%
@@ -128,11 +146,11 @@ start:
                     break;
                 }
                 if (*bp == '\n') {
-                    putc(*bp, stdout);
+                    prologue(*bp);
                     if (nextline() == NULL)
                         break;
                 } else {
-                    putc(*bp++, stdout);
+                    prologue(*bp++);
                 }
             }
         }
@@ -207,6 +225,9 @@ start:
             } else if (!strncmp(bp, "term", 4) && p - bp == 4) {
                 bp += 4;
                 return TERM;
+            } else if (!strncmp(bp, "costs", 5) && p - bp == 5) {
+                bp += 5;
+                return COSTS;
             } else {
                 return c;
             }